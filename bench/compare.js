@@ -0,0 +1,75 @@
+/**
+ * Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+ * This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+ **/
+'use strict'
+
+// Usage: node bench/compare.js <base.json> <head.json> [--threshold <percent>]
+// Prints the p50 and p99 change of every benchmark present in both reports and exits with 1 when a p50
+// regressed by more than the threshold (10% by default)
+
+const fs = require('fs')
+
+function parseArgs (argv) {
+  const args = { files: [], threshold: 10 }
+  for (let i = 0; i < argv.length; ++i) {
+    if (argv[i] === '--threshold') {
+      args.threshold = Number(argv[++i])
+    } else {
+      args.files.push(argv[i])
+    }
+  }
+  if (args.files.length !== 2) {
+    throw new Error('Usage: node bench/compare.js <base.json> <head.json> [--threshold <percent>]')
+  }
+  return args
+}
+
+function change (base, head) {
+  return (head - base) / base * 100
+}
+
+function format (percent) {
+  return `${percent >= 0 ? '+' : ''}${percent.toFixed(1)}%`
+}
+
+function main () {
+  const args = parseArgs(process.argv.slice(2))
+  const [base, head] = args.files.map(file => JSON.parse(fs.readFileSync(file, 'utf8')))
+
+  const baseResults = new Map(base.results.map(result => [result.name, result]))
+
+  const rows = []
+  let regressed = false
+
+  for (const result of head.results) {
+    const previous = baseResults.get(result.name)
+    if (!previous) continue
+
+    const p50 = change(previous.p50, result.p50)
+    const p99 = change(previous.p99, result.p99)
+    const isRegression = p50 > args.threshold
+
+    regressed = regressed || isRegression
+
+    rows.push([
+      result.name,
+      `${previous.p50}ns`,
+      `${result.p50}ns`,
+      format(p50),
+      format(p99),
+      isRegression ? 'REGRESSION' : ''
+    ])
+  }
+
+  const header = ['benchmark', 'base p50', 'head p50', 'p50', 'p99', '']
+  const widths = header.map((title, i) => Math.max(title.length, ...rows.map(row => row[i].length)))
+
+  for (const row of [header, ...rows]) {
+    process.stdout.write(row.map((cell, i) => cell.padEnd(widths[i])).join('  ').trimEnd() + '\n')
+  }
+
+  process.exitCode = regressed ? 1 : 0
+}
+
+main()
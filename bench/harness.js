@@ -0,0 +1,72 @@
+/**
+ * Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+ * This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+ **/
+'use strict'
+
+const DEFAULT_WARMUP = 100
+const DEFAULT_ITERATIONS = 1000
+
+function percentile (sorted, p) {
+  const index = Math.min(sorted.length - 1, Math.ceil(p / 100 * sorted.length) - 1)
+  return sorted[Math.max(0, index)]
+}
+
+// Calls fn once per iteration and records each call separately so that latency percentiles can be reported.
+// setup, when given, runs before every call outside of the measured time and its return value is passed to fn.
+function measure (name, fn, options = {}) {
+  const warmup = options.warmup ?? DEFAULT_WARMUP
+  const iterations = options.iterations ?? DEFAULT_ITERATIONS
+  const setup = options.setup
+  const teardown = options.teardown
+
+  for (let i = 0; i < warmup; ++i) {
+    const state = setup ? setup() : undefined
+    fn(state)
+    if (teardown) teardown(state)
+  }
+
+  const samples = new Float64Array(iterations)
+
+  for (let i = 0; i < iterations; ++i) {
+    const state = setup ? setup() : undefined
+    const start = process.hrtime.bigint()
+    fn(state)
+    samples[i] = Number(process.hrtime.bigint() - start)
+    if (teardown) teardown(state)
+  }
+
+  samples.sort()
+
+  let total = 0
+  for (let i = 0; i < iterations; ++i) {
+    total += samples[i]
+  }
+
+  const mean = total / iterations
+
+  const result = {
+    name,
+    iterations,
+    // all durations are in nanoseconds
+    mean: Math.round(mean),
+    min: samples[0],
+    p50: percentile(samples, 50),
+    p90: percentile(samples, 90),
+    p99: percentile(samples, 99),
+    max: samples[iterations - 1],
+    opsPerSec: Math.round(1e9 / mean)
+  }
+
+  if (options.bytes) {
+    result.bytesPerSec = Math.round(options.bytes * 1e9 / mean)
+  }
+
+  if (options.nodes) {
+    result.nsPerNode = Math.round(mean / options.nodes * 10) / 10
+  }
+
+  return result
+}
+
+module.exports = { measure }
@@ -0,0 +1,349 @@
+/**
+ * Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+ * This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+ **/
+'use strict'
+
+// Usage: node bench [--filter <substring>] [--iterations <n>] [--out <file>]
+// Results are printed as JSON on stdout, or written to the --out file, to be diffed with bench/compare.js
+
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+const { execSync } = require('child_process')
+
+const { DDWAF } = require('..')
+const pkg = require('../package.json')
+const rules = require('../test/rules.json')
+const processor = require('../test/processor.json')
+const blns = require('../test/blns.json')
+const { measure } = require('./harness')
+
+const TIMEOUT = 9999e3
+const CONVERSION_ADDRESS = 'bench.conversion'
+
+let filter
+
+function add (results, name, fn, options) {
+  if (!filter || name.includes(filter)) {
+    results.push(measure(name, fn, options))
+  }
+}
+
+function parseArgs (argv) {
+  const args = {}
+  for (let i = 0; i < argv.length; ++i) {
+    switch (argv[i]) {
+      case '--filter':
+        args.filter = argv[++i]
+        break
+      case '--iterations':
+        args.iterations = Number(argv[++i])
+        break
+      case '--out':
+        args.out = argv[++i]
+        break
+      default:
+        throw new Error(`Unknown argument ${argv[i]}`)
+    }
+  }
+  return args
+}
+
+// A rule reading a key that is never sent: the WAF looks the key up without walking the value,
+// so running it measures the conversion of the payload and not the evaluation of the rules
+const conversionRules = {
+  version: '2.2',
+  metadata: { rules_version: '1.0.0' },
+  rules: [{
+    id: 'bench-conversion',
+    name: 'bench-conversion',
+    tags: { type: 'bench', category: 'bench' },
+    conditions: [{
+      parameters: {
+        inputs: [{ address: CONVERSION_ADDRESS, key_path: ['__never_sent__'] }],
+        regex: '^$'
+      },
+      operator: 'match_regex'
+    }]
+  }]
+}
+
+function nested (depth, leaf) {
+  let value = leaf
+  for (let i = 0; i < depth; ++i) {
+    value = { child: value }
+  }
+  return value
+}
+
+function wide (size) {
+  const value = {}
+  for (let i = 0; i < size; ++i) {
+    value[`key${i}`] = `value${i}`
+  }
+  return value
+}
+
+function tree (width, depth) {
+  const value = {}
+  for (let i = 0; i < width; ++i) {
+    value[`key${i}`] = depth > 1 ? tree(width, depth - 1) : `value${i}`
+  }
+  return value
+}
+
+// Values converted for an address with the default limits, to report the cost per converted node
+function countNodes (value, depth = 1, maxDepth = 20, maxSize = 256) {
+  if (depth >= maxDepth || value === null || typeof value !== 'object' || ArrayBuffer.isView(value)) {
+    return 1
+  }
+  const entries = Object.values(value).slice(0, maxSize)
+  return entries.reduce((count, entry) => count + countNodes(entry, depth + 1, maxDepth, maxSize), 1)
+}
+
+function chunked (strings, size) {
+  const value = {}
+  for (let i = 0; i < strings.length; i += size) {
+    value[`chunk${i}`] = strings.slice(i, i + size)
+  }
+  return value
+}
+
+const payloadShapes = {
+  'wide-map-100': wide(100),
+  'wide-map-256': wide(256),
+  'wide-map-10000': wide(10000),
+  'deep-nesting-20': nested(20, 'leaf'),
+  'deep-nesting-100': nested(100, 'leaf'),
+  'tree-4x6': tree(4, 6),
+  'wide-array-10000': Array.from({ length: 10000 }, (_, i) => ({ id: i, name: `name${i}` })),
+  'long-string-4k': 'a'.repeat(4096),
+  'long-string-1m': 'a'.repeat(1024 * 1024),
+  'long-string-1m-multibyte': 'é'.repeat(512 * 1024),
+  'buffer-64k': Buffer.alloc(64 * 1024, 'a'),
+  blns: chunked(blns, 200)
+}
+
+function benchConversion (iterations) {
+  const waf = new DDWAF(conversionRules, 'bench')
+  const context = waf.createContext()
+  const results = []
+
+  for (const [shape, value] of Object.entries(payloadShapes)) {
+    add(results, `to_ddwaf_object.${shape}`, () => {
+      context.run({ ephemeral: { [CONVERSION_ADDRESS]: value } }, TIMEOUT)
+    }, { iterations, nodes: countNodes(value) })
+  }
+
+  context.dispose()
+  waf.dispose()
+
+  return results
+}
+
+function benchResultConversion (iterations) {
+  const results = []
+
+  const waf = new DDWAF(rules, 'recommended')
+  const context = waf.createContext()
+
+  add(results, 'from_ddwaf_object.events', () => {
+    const result = context.run({ ephemeral: { 'server.request.headers.no_cookies': 'value_attack' } }, TIMEOUT)
+    return result.events
+  }, { iterations })
+
+  add(results, 'from_ddwaf_object.actions', () => {
+    const result = context.run({ ephemeral: { custom_value_attack: 'match' } }, TIMEOUT)
+    return result.actions
+  }, { iterations })
+
+  const diagnostics = waf.getConfigDiagnostics('recommended')
+
+  add(results, 'from_ddwaf_object.diagnostics', () => {
+    return waf.getConfigDiagnostics('recommended')
+  }, { iterations, nodes: countNodes(diagnostics, 0, Infinity, Infinity) })
+
+  context.dispose()
+  waf.dispose()
+
+  const processorWaf = new DDWAF(processor, 'processor_rules')
+  const body = chunked(blns, 200)
+
+  add(results, 'from_ddwaf_object.attributes', (processorContext) => {
+    const result = processorContext.run({
+      persistent: {
+        'server.request.body': body,
+        'waf.context.processor': { 'extract-schema': true }
+      }
+    }, TIMEOUT)
+    return result.attributes
+  }, {
+    iterations,
+    setup: () => processorWaf.createContext(),
+    teardown: (processorContext) => processorContext.dispose()
+  })
+
+  processorWaf.dispose()
+
+  return results
+}
+
+function benchRun (iterations) {
+  const waf = new DDWAF(rules, 'recommended')
+  const results = []
+
+  const payloads = {
+    'no-match': { 'server.request.headers.no_cookies': 'normal_value' },
+    match: { 'server.request.headers.no_cookies': 'value_attack' },
+    'block-action': { custom_value_attack: 'match' },
+    'body-no-match': { 'server.request.body': wide(256) }
+  }
+
+  for (const [name, payload] of Object.entries(payloads)) {
+    add(results, `run.${name}`, (context) => {
+      context.run({ persistent: payload }, TIMEOUT)
+    }, {
+      iterations,
+      setup: () => waf.createContext(),
+      teardown: (context) => context.dispose()
+    })
+  }
+
+  const batch = new Array(10).fill({ ephemeral: payloads['no-match'] })
+
+  add(results, 'run.batch-10-loop', (context) => {
+    for (const payload of batch) {
+      context.run(payload, TIMEOUT)
+    }
+  }, {
+    iterations,
+    setup: () => waf.createContext(),
+    teardown: (context) => context.dispose()
+  })
+
+  add(results, 'runBatch.batch-10', (context) => {
+    context.runBatch(batch, TIMEOUT)
+  }, {
+    iterations,
+    setup: () => waf.createContext(),
+    teardown: (context) => context.dispose()
+  })
+
+  waf.dispose()
+
+  return results
+}
+
+function benchContext (iterations) {
+  const waf = new DDWAF(rules, 'recommended')
+
+  const results = []
+
+  add(results, 'createContext', () => {
+    waf.createContext().dispose()
+  }, { iterations })
+
+  // the pool only keeps the arenas of disposed contexts, which pays off once runs have grown them
+  const pooledWaf = new DDWAF(rules, 'recommended', { contextPoolSize: 4 })
+  const payload = { persistent: { 'server.request.body': { list: blns.slice(0, 200) } } }
+
+  add(results, 'createContext.run', () => {
+    const context = waf.createContext()
+    context.run(payload, TIMEOUT)
+    context.dispose()
+  }, { iterations })
+
+  add(results, 'createContext.run.pooled', () => {
+    const context = pooledWaf.createContext()
+    context.run(payload, TIMEOUT)
+    context.dispose()
+  }, { iterations })
+
+  pooledWaf.dispose()
+  waf.dispose()
+
+  return results
+}
+
+function benchConfig (iterations) {
+  const results = []
+
+  add(results, 'constructor', () => {
+    new DDWAF(rules, 'recommended').dispose()
+  }, { iterations })
+
+  const waf = new DDWAF(rules, 'recommended')
+
+  add(results, 'createOrUpdateConfig', () => {
+    waf.createOrUpdateConfig(processor, 'processor_rules')
+  }, {
+    iterations,
+    teardown: () => waf.removeConfig('processor_rules')
+  })
+
+  add(results, 'removeConfig', () => {
+    waf.removeConfig('processor_rules')
+  }, {
+    iterations,
+    setup: () => waf.createOrUpdateConfig(processor, 'processor_rules')
+  })
+
+  add(results, 'applyConfigs', () => {
+    waf.applyConfigs([
+      { path: 'processor_rules', config: processor },
+      { path: 'processor_rules' }
+    ])
+  }, { iterations })
+
+  waf.dispose()
+
+  return results
+}
+
+function gitCommit () {
+  try {
+    return execSync('git rev-parse HEAD', { cwd: path.join(__dirname, '..'), stdio: ['ignore', 'pipe', 'ignore'] })
+      .toString().trim()
+  } catch (e) {
+    return undefined
+  }
+}
+
+function main () {
+  const args = parseArgs(process.argv.slice(2))
+  filter = args.filter
+
+  const suites = [
+    [benchConversion, 200],
+    [benchResultConversion, 1000],
+    [benchRun, 1000],
+    [benchContext, 5000],
+    [benchConfig, 50]
+  ]
+
+  let results = []
+  for (const [suite, iterations] of suites) {
+    results = results.concat(suite(args.iterations || iterations))
+  }
+
+  const report = {
+    version: pkg.version,
+    libddwaf: DDWAF.version(),
+    commit: gitCommit(),
+    node: process.version,
+    platform: `${os.platform()}-${os.arch()}`,
+    date: new Date().toISOString(),
+    results
+  }
+
+  const json = JSON.stringify(report, null, 2)
+
+  if (args.out) {
+    fs.writeFileSync(args.out, json + '\n')
+  } else {
+    process.stdout.write(json + '\n')
+  }
+}
+
+main()
@@ -12,7 +12,9 @@
     ],
     "sources": [
       "src/convert.cpp",
-      "src/main.cpp"
+      "src/encoded_payload.cpp",
+      "src/main.cpp",
+      "src/raw_json.cpp"
     ],
     "defines": [ "NAPI_DISABLE_CPP_EXCEPTIONS" ],
     "xcode_settings": {
@@ -0,0 +1,192 @@
+/**
+ * Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+ * This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+ **/
+'use strict'
+
+// Encoder for the payload format documented in src/encoded_payload.h
+
+const VERSION = 1
+
+const NULL = 0x00
+const FALSE = 0x01
+const TRUE = 0x02
+const SIGNED = 0x03
+const UNSIGNED = 0x04
+const FLOAT = 0x05
+const STRING = 0x06
+const ARRAY = 0x07
+const MAP = 0x08
+
+// DDWAF_MAX_CONTAINER_DEPTH, deeper values are written as the empty map the addon would convert them to.
+// Addresses with a larger maxContainerDepth in addressLimits need a larger maxDepth.
+const MAX_DEPTH = 20
+
+const INITIAL_SIZE = 1024
+
+class Writer {
+  constructor (maxDepth) {
+    this.buffer = Buffer.allocUnsafe(INITIAL_SIZE)
+    this.offset = 0
+    this.maxDepth = maxDepth
+  }
+
+  reserve (size) {
+    if (this.offset + size > this.buffer.length) {
+      const buffer = Buffer.allocUnsafe(Math.max(this.buffer.length * 2, this.offset + size))
+      this.buffer.copy(buffer, 0, 0, this.offset)
+      this.buffer = buffer
+    }
+  }
+
+  u8 (value) {
+    this.reserve(1)
+    this.buffer[this.offset++] = value
+  }
+
+  u32 (value) {
+    this.reserve(4)
+    this.offset = this.buffer.writeUInt32LE(value, this.offset)
+  }
+
+  string (value) {
+    const length = Buffer.byteLength(value)
+    this.u32(length)
+    this.reserve(length)
+    this.offset += this.buffer.write(value, this.offset, length)
+  }
+
+  bytes (value) {
+    this.u32(value.byteLength)
+    this.reserve(value.byteLength)
+    this.buffer.set(value, this.offset)
+    this.offset += value.byteLength
+  }
+}
+
+// Same rules as the conversion of JS payloads, except that values the WAF cannot use (undefined, functions,
+// symbols and circular references) are left out of objects and encoded as null in arrays
+function isEncodable (value, seen) {
+  switch (typeof value) {
+    case 'undefined':
+    case 'function':
+    case 'symbol':
+      return false
+    case 'object':
+      return value === null || !seen.has(value)
+    default:
+      return true
+  }
+}
+
+function binaryView (value) {
+  if (value instanceof ArrayBuffer) {
+    return new Uint8Array(value)
+  }
+  if (ArrayBuffer.isView(value) && value.BYTES_PER_ELEMENT === 1) {
+    return new Uint8Array(value.buffer, value.byteOffset, value.byteLength)
+  }
+}
+
+function writeValue (writer, value, depth, seen, ignoreToJSON) {
+  if (depth >= writer.maxDepth) {
+    writer.u8(MAP)
+    writer.u32(0)
+    return
+  }
+
+  switch (typeof value) {
+    case 'string':
+      writer.u8(STRING)
+      writer.string(value)
+      return
+    case 'number':
+      writer.u8(FLOAT)
+      writer.reserve(8)
+      writer.offset = writer.buffer.writeDoubleLE(value, writer.offset)
+      return
+    case 'boolean':
+      writer.u8(value ? TRUE : FALSE)
+      return
+    case 'bigint':
+      writer.u8(value < 0n ? SIGNED : UNSIGNED)
+      writer.reserve(8)
+      writer.offset = value < 0n
+        ? writer.buffer.writeBigInt64LE(BigInt.asIntN(64, value), writer.offset)
+        : writer.buffer.writeBigUInt64LE(BigInt.asUintN(64, value), writer.offset)
+      return
+  }
+
+  if (value === null || !isEncodable(value, seen)) {
+    writer.u8(NULL)
+    return
+  }
+
+  const bytes = binaryView(value)
+  if (bytes) {
+    writer.u8(STRING)
+    writer.bytes(bytes)
+    return
+  }
+
+  if (!ignoreToJSON && typeof value.toJSON === 'function') {
+    writeValue(writer, value.toJSON(), depth, seen, true)
+    return
+  }
+
+  seen.add(value)
+  if (Array.isArray(value)) {
+    writer.u8(ARRAY)
+    writer.u32(value.length)
+    for (const item of value) {
+      writeValue(writer, isEncodable(item, seen) ? item : null, depth + 1, seen, false)
+    }
+  } else {
+    writer.u8(MAP)
+    writeEntries(writer, value, depth + 1, seen)
+  }
+  seen.delete(value)
+}
+
+// Writes the entry count and the entries of an object, the count is patched once the skipped entries are known
+function writeEntries (writer, object, depth, seen) {
+  const countOffset = writer.offset
+  writer.u32(0)
+
+  let count = 0
+  for (const key of Object.keys(object)) {
+    const value = object[key]
+    if (!isEncodable(value, seen)) continue
+
+    writer.string(key)
+    writeValue(writer, value, depth, seen, false)
+    count++
+  }
+
+  writer.buffer.writeUInt32LE(count, countOffset)
+}
+
+// Encodes an address map, the result can be passed as the persistent or ephemeral field of a run() payload
+function encodePayload (addresses, maxDepth = MAX_DEPTH) {
+  if (addresses === null || typeof addresses !== 'object' || Array.isArray(addresses)) {
+    throw new TypeError('Addresses must be an object')
+  }
+
+  if (typeof maxDepth !== 'number' || !(maxDepth >= 1)) {
+    throw new TypeError('maxDepth must be a positive number')
+  }
+
+  const writer = new Writer(maxDepth)
+  writer.u8(0x44) // D
+  writer.u8(0x44) // D
+  writer.u8(0x57) // W
+  writer.u8(VERSION)
+
+  // the address map itself is never serialized through toJSON, its values are
+  writer.u8(MAP)
+  writeEntries(writer, addresses, 1, new Set([addresses]))
+
+  return writer.buffer.subarray(0, writer.offset)
+}
+
+module.exports = { encodePayload }
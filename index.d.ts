@@ -22,15 +22,38 @@ type diagnosticsError = {
 
 type diagnosticsResult = diagnosticsInfo | diagnosticsError
 
-type TruncationMetrics = {
+type diagnostics = {
+  ruleset_version?: string,
+  rules?: diagnosticsResult,
+  custom_rules?: diagnosticsResult,
+  exclusions?: diagnosticsResult,
+  rules_override?: diagnosticsResult,
+  rules_data?: diagnosticsResult,
+  processors?: diagnosticsResult,
+  actions?: diagnosticsResult
+}
+
+type AddressTruncationMetrics = {
   maxTruncatedString?: number;
   maxTruncatedContainerSize?: number;
   maxTruncatedContainerDepth?: number;
 }
 
+type TruncationMetrics = AddressTruncationMetrics & {
+  truncatedAddresses?: { [address: string]: AddressTruncationMetrics }; // only the addresses that were truncated
+  skippedAddresses?: number; // top-level addresses not consumed by any rule, left out of the conversion
+  // encoded size of the values skipped in encoded payloads only, JS payloads are skipped without reading their values
+  skippedBytes?: number;
+  overload?: 'degraded' | 'skipped'; // the run was degraded or skipped by the overload protection
+  shedAddresses?: number; // addresses left out of a degraded run
+}
+
 type result = {
   timeout: boolean;
   duration?: number;
+  conversionDuration?: number; // time spent converting the payload, in ns
+  conversionTimeout?: boolean; // the payload conversion used up the timeout and was cut short
+  conversionOverBudget?: boolean; // the payload conversion reached maxConvertedNodes or maxConvertedBytes
   events?: object[]; // https://github.com/DataDog/libddwaf/blob/master/schema/events.json
   status?: 'match'; // TODO: remove this if new statuses are never added
   actions?: object[];
@@ -41,46 +64,144 @@ type result = {
 }
 
 type payload = {
-  persistent?: object,
-  ephemeral?: object
+  // either an address map or its encoding by encodePayload()
+  persistent?: object | ArrayBuffer | Uint8Array,
+  ephemeral?: object | ArrayBuffer | Uint8Array
+}
+
+// at most 16777216 bytes, 1048576 entries and 256 levels
+type conversionLimits = {
+  maxStringLength?: number,
+  maxContainerSize?: number,
+  maxContainerDepth?: number
+}
+
+type conversionOptions = {
+  // limits of the conversion of specific addresses, the others keep the libddwaf defaults (4096, 256 and 20)
+  addressLimits?: { [address: string]: conversionLimits },
+  // stop converting a run payload once this many values or bytes were converted
+  maxConvertedNodes?: number,
+  maxConvertedBytes?: number,
+  // once the time spent in conversions and in the WAF goes past cpuBudget µs per second, runs only convert
+  // degradedAddresses (the request headers by default) and are then skipped. Runs are also degraded while the
+  // event loop lags behind by more than lagThreshold ms.
+  overload?: {
+    cpuBudget: number,
+    lagThreshold?: number,
+    degradedAddresses?: string[]
+  }
+}
+
+// encodes an address map in the compact format documented in src/encoded_payload.h, values deeper than maxDepth
+// (20 by default) are left out
+export function encodePayload(addresses: object, maxDepth?: number): Uint8Array;
+
+declare class RawJson {
+  readonly body: string | Uint8Array | ArrayBuffer;
 }
 
 declare class DDWAFContext {
   readonly disposed: boolean;
 
   run(payload: payload, timeout: number): result;
+  runAsync(payload: payload, timeout: number): Promise<result>;
+  // run every payload in sequence under a single timeout, with shortCircuit only the result of the first match is
+  // returned, along with the index of its payload
+  runBatch(payloads: payload[], timeout: number): result[];
+  runBatch(payloads: payload[], timeout: number, shortCircuit: true): (result & { index: number }) | null;
+
+  // stream a request body sent as the persistent address, only its first 4096 bytes (or the maxStringLength of the
+  // address) are buffered and the WAF runs on them as soon as they are received, or on endBody() for shorter bodies
+  beginBody(address: string, timeout: number): void;
+  pushChunk(chunk: string | Uint8Array | ArrayBuffer): result | undefined;
+  endBody(): result | undefined;
   dispose(): void;
 }
 
 export class DDWAF {
   static version(): string;
 
+  // create an instance using the ruleset shared by share(), possibly from another thread.
+  // config updates made through any instance using the ruleset apply to all of them.
+  // libddwaf keeps the limits of the instance that built the ruleset, addressLimits cannot go past them.
+  static attach(id: number, config?: conversionOptions & {
+    memoizePersistent?: boolean,
+    lazyResults?: boolean,
+    contextPoolSize?: number,
+    verdictCacheSize?: number
+  }): DDWAF;
+
+  // wrap a JSON document so that it is parsed natively when given as the value of an address of a run() payload,
+  // a body that is not valid JSON is passed to the WAF as a string
+  static rawJson(body: string | Uint8Array | ArrayBuffer): RawJson;
+
+  // name of each entry of counters, in the same order
+  static readonly counterNames: readonly string[];
+
   readonly disposed: boolean;
 
   readonly configPaths: string[];
 
-  readonly diagnostics: {
-    ruleset_version?: string,
-    rules?: diagnosticsResult,
-    custom_rules?: diagnosticsResult,
-    exclusions?: diagnosticsResult,
-    rules_override?: diagnosticsResult,
-    rules_data?: diagnosticsResult,
-    processors?: diagnosticsResult,
-    actions?: diagnosticsResult
+  // diagnostics of the last config update, converted on first read
+  readonly diagnostics: diagnostics;
+
+  // counts over every section of diagnostics, computed without converting them
+  readonly diagnosticsSummary: {
+    rulesetVersion?: string,
+    loaded: number,
+    failed: number,
+    skipped: number,
+    errors: number,
+    warnings: number
   };
 
   readonly knownAddresses: Set<string>;
   readonly knownActions: Set<string>;
 
-  constructor(rules: rules, rulesPath: string, config?: {
+  // cumulative counters of the instance and of its contexts, updated in place
+  readonly counters: BigUint64Array;
+
+  // state of the overload protection in µs, null when it is disabled
+  readonly overload: {
+    remainingBudget: number,
+    averageRunCost: number,
+    averageLoopLag: number
+  } | null;
+
+  constructor(rules: rules, rulesPath: string, config?: conversionOptions & {
     obfuscatorKeyRegex?: string,
-    obfuscatorValueRegex?: string
+    obfuscatorValueRegex?: string,
+    // do not send again a persistent address whose value is the rawJson() wrapper of a string last sent for it
+    memoizePersistent?: boolean,
+    // convert events, actions and attributes of run() results on first read
+    lazyResults?: boolean,
+    // keep the memory of up to this many disposed contexts for reuse by createContext
+    contextPoolSize?: number,
+    // remember up to this many ephemeral-only payloads that did not match, to skip the WAF when they are sent again
+    verdictCacheSize?: number
   });
 
+  // the sync config methods and configPaths wait for a config update made by an attached instance to finish
   createOrUpdateConfig(config: rules, path: string): boolean;
   removeConfig(path: string): boolean;
 
+  // diagnostics of the last update of a config path, undefined once it is removed
+  getConfigDiagnostics(path: string): diagnostics | undefined;
+
+  // apply every operation, an operation without config removes its path, and rebuild the ruleset once
+  applyConfigs(operations: { path: string, config?: rules }[]): {
+    path: string,
+    success: boolean,
+    diagnostics?: object
+  }[];
+
+  // build the new ruleset on the threadpool, the sync config methods throw until the returned promise settles
+  createOrUpdateConfigAsync(config: rules, path: string): Promise<boolean>;
+  removeConfigAsync(path: string): Promise<boolean>;
+
+  // register the ruleset of this instance for DDWAF.attach(), it stays attachable while an instance uses it
+  share(): number;
+
   createContext(): DDWAFContext;
   dispose(): void;
 }
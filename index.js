@@ -4,4 +4,7 @@
  **/
 'use strict'
 
-module.exports = require('node-gyp-build')(__dirname)
+const addon = require('node-gyp-build')(__dirname)
+const { encodePayload } = require('./encode')
+
+module.exports = { ...addon, encodePayload }
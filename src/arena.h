@@ -0,0 +1,163 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+
+#ifndef SRC_ARENA_H_
+#define SRC_ARENA_H_
+
+#include <ddwaf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+// Bump allocator backing the ddwaf_object trees built by to_ddwaf_object.
+// Every string and container of a converted payload lives in the arena, so the whole tree is released at once
+// with reset() or release() instead of one free() per node. The WAF is configured without a free_fn, the owner
+// of the arena decides when the data handed to ddwaf_run can go away.
+class Arena {
+ public:
+  Arena() : _head(nullptr) {}
+  ~Arena() {
+    this->release();
+  }
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // The blocks move along, the moved-from arena is left empty
+  Arena(Arena&& other) noexcept : _head(other._head) {
+    other._head = nullptr;
+  }
+
+  Arena& operator=(Arena&& other) noexcept {
+    if (this != &other) {
+      this->release();
+      this->_head = other._head;
+      other._head = nullptr;
+    }
+    return *this;
+  }
+
+  void* allocate(size_t size, size_t align = alignof(ddwaf_object)) {
+    if (size == 0) {
+      size = 1;
+    }
+
+    if (this->_head != nullptr) {
+      size_t offset = align_up(this->_head->used, align);
+      if (offset + size <= this->_head->capacity) {
+        this->_head->used = offset + size;
+        return this->_head->data() + offset;
+      }
+    }
+
+    size_t capacity = FIRST_BLOCK_SIZE;
+    if (this->_head != nullptr) {
+      capacity = std::min(this->_head->capacity * 2, MAX_BLOCK_SIZE);
+    }
+    capacity = std::max(capacity, size + align);
+
+    Block* block = static_cast<Block*>(std::malloc(sizeof(Block) + capacity));
+    if (block == nullptr) {
+      return nullptr;
+    }
+    block->next = this->_head;
+    block->capacity = capacity;
+    block->used = 0;
+    this->_head = block;
+
+    size_t offset = align_up(0, align);
+    block->used = offset + size;
+    return block->data() + offset;
+  }
+
+  ddwaf_object* allocate_objects(size_t count) {
+    return static_cast<ddwaf_object*>(this->allocate(count * sizeof(ddwaf_object), alignof(ddwaf_object)));
+  }
+
+  // Returns a NUL terminated copy of the first length bytes of data
+  char* copy_string(const char* data, size_t length) {
+    char* copy = static_cast<char*>(this->allocate(length + 1, 1));
+    if (copy == nullptr) {
+      return nullptr;
+    }
+    if (length > 0) {
+      memcpy(copy, data, length);
+    }
+    copy[length] = '\0';
+    return copy;
+  }
+
+  // Gives back the unused tail of the most recent allocation, ptr must be the value returned by that allocation
+  void shrink_last(void* ptr, size_t size) {
+    if (this->_head == nullptr) {
+      return;
+    }
+    char* data = this->_head->data();
+    char* start = static_cast<char*>(ptr);
+    if (start >= data && start + size <= data + this->_head->used) {
+      this->_head->used = static_cast<size_t>(start - data) + size;
+    }
+  }
+
+  // Drops everything allocated so far but keeps the most recent block of at most MAX_KEPT_BLOCK_SIZE bytes around
+  // for the next conversion, so that one large payload does not pin its memory for the lifetime of the arena
+  void reset() {
+    Block* kept = nullptr;
+    Block* block = this->_head;
+    while (block != nullptr) {
+      Block* next = block->next;
+      if (kept == nullptr && block->capacity <= MAX_KEPT_BLOCK_SIZE) {
+        kept = block;
+      } else {
+        std::free(block);
+      }
+      block = next;
+    }
+    if (kept != nullptr) {
+      kept->next = nullptr;
+      kept->used = 0;
+    }
+    this->_head = kept;
+  }
+
+  void release() {
+    free_blocks(this->_head);
+    this->_head = nullptr;
+  }
+
+ private:
+  static constexpr size_t FIRST_BLOCK_SIZE = 16 * 1024;
+  static constexpr size_t MAX_BLOCK_SIZE = 1024 * 1024;
+  static constexpr size_t MAX_KEPT_BLOCK_SIZE = 64 * 1024;
+
+  struct Block {
+    Block* next;
+    size_t capacity;
+    size_t used;
+
+    char* data() {
+      return reinterpret_cast<char*>(this + 1);
+    }
+  };
+
+  static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+  }
+
+  static void free_blocks(Block* block) {
+    while (block != nullptr) {
+      Block* next = block->next;
+      std::free(block);
+      block = next;
+    }
+  }
+
+  Block* _head;
+};
+
+#endif  // SRC_ARENA_H_
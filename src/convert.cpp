@@ -7,310 +7,756 @@
 #include <napi-inl.h>
 #include <ddwaf.h>
 
+#include <cstdint>
+#include <deque>
 #include <limits>
 #include <string>
 #include <algorithm>
+#include <vector>
 
 #include "src/convert.h"
 #include "src/log.h"
-#include "src/jsset.h"
+#include "src/object_stack.h"
+#include "src/arena.h"
+#include "src/raw_json.h"
 
-ddwaf_object* to_ddwaf_object(
-  ddwaf_object *object,
-  Napi::Env env,
-  Napi::Value val,
-  int depth,
-  bool lim,
-  bool ignoreToJSON,
-  JsSet stack,
-  WAFTruncationMetrics* metrics
-);
-
-ddwaf_object* to_ddwaf_object_array(
-  ddwaf_object *object,
-  Napi::Env env,
-  Napi::Array arr,
-  int depth,
-  bool lim,
-  bool ignoreToJSON,
-  JsSet stack,
-  WAFTruncationMetrics* metrics
+// Copies the UTF-8 encoding of a JS string into the arena, transcoding at most max_length bytes.
+// The UTF-8 length of the whole string is only computed when it may exceed max_length, in which case it is
+// reported through full_length so that truncations can still be measured.
+const char* copy_utf8_string(
+  napi_env env,
+  napi_value str,
+  size_t max_length,
+  Arena *arena,
+  size_t *length,
+  size_t *full_length
 ) {
-  if (!ignoreToJSON) {
-    Napi::Value toJSON = arr.Get("toJSON");
-    if (toJSON.IsFunction()) {
-      Napi::Value toJSONResult = toJSON.As<Napi::Function>().Call(arr, {});
-      if (env.IsExceptionPending()) {
-        mlog("Exception pending");
-        env.GetAndClearPendingException();
-        return ddwaf_object_invalid(object);
-      }
-      return to_ddwaf_object(object, env, toJSONResult, depth, lim, true, stack, metrics);
-    }
+  *length = 0;
+  *full_length = 0;
+
+  // O(1), V8 knows the number of UTF-16 code units of a string
+  size_t utf16_length = 0;
+  if (napi_get_value_string_utf16(env, str, nullptr, 0, &utf16_length) != napi_ok) {
+    return nullptr;
   }
 
-  uint32_t len = arr.Length();
-  if (env.IsExceptionPending()) {
-    mlog("Exception pending");
+  // a single UTF-16 code unit never takes more than 3 bytes in UTF-8
+  bool bounded = utf16_length <= max_length / 3;
+  size_t capacity = bounded ? utf16_length * 3 : max_length;
+
+  char* buffer = static_cast<char*>(arena->allocate(capacity + 1, 1));
+  if (buffer == nullptr) {
     return nullptr;
   }
-  ddwaf_object* objectRes = ddwaf_object_array(object);
-  if (objectRes == nullptr) {
-    mlog("failed to create array");
+
+  size_t written = 0;
+  if (napi_get_value_string_utf8(env, str, buffer, capacity + 1, &written) != napi_ok) {
+    arena->shrink_last(buffer, 0);
     return nullptr;
   }
-  // TODO(@vdeturckheim): handle arrays with
-  // more than DDWAF_MAX_CONTAINER_SIZE chars
-  if (lim && len > DDWAF_MAX_CONTAINER_SIZE) {
-    if (metrics) {
-      metrics->max_truncated_container_size = std::max(metrics->max_truncated_container_size,
-                                                       static_cast<size_t>(len));
-    }
-    len = DDWAF_MAX_CONTAINER_SIZE;
+  arena->shrink_last(buffer, written + 1);
+
+  *length = written;
+  *full_length = written;
+
+  // the encoder stops before a character that does not fit, and no character takes more than 4 bytes
+  if (!bounded && (utf16_length > max_length || written + 4 > max_length)) {
+    size_t utf8_length = 0;
+    if (napi_get_value_string_utf8(env, str, nullptr, 0, &utf8_length) == napi_ok) {
+      *full_length = utf8_length;
+    }
+  }
+
+  return buffer;
+}
+
+ddwaf_object* to_ddwaf_string(
+  ddwaf_object *object,
+  napi_env env,
+  napi_value val,
+  const ConversionLimits *limits,
+  Arena *arena,
+  WAFTruncationMetrics* metrics
+) {
+  size_t max_length = limits ? limits->max_string_length : SIZE_MAX;
+  size_t length = 0;
+  size_t full_length = 0;
+  const char* str = copy_utf8_string(env, val, max_length, arena, &length, &full_length);
+  if (str == nullptr) {
+    return ddwaf_object_invalid(object);
+  }
+  if (metrics) {
+    metrics->converted_bytes += length;
+    if (full_length > length) {
+      metrics->max_truncated_string_length = std::max(metrics->max_truncated_string_length, full_length);
+      metrics->truncated_strings++;
+    }
   }
-  for (uint32_t i = 0; i < len; ++i) {
-    Napi::Value item  = arr.Get(i);
-    ddwaf_object val;
-    to_ddwaf_object(&val, env, item, depth, lim, false, stack, metrics);
-    if (!ddwaf_object_array_add(object, &val)) {
-      mlog("add to array failed, freeing");
-      ddwaf_object_free(&val);
+  return ddwaf_object_stringl_nc(object, str, length);
+}
+
+// Returns false for any other value, wider TypedArrays keep being converted element by element
+bool get_binary_data(napi_env env, napi_value val, const char** data, size_t* length) {
+  bool is_binary = false;
+  void* bytes = nullptr;
+
+  if (napi_is_typedarray(env, val, &is_binary) == napi_ok && is_binary) {
+    napi_typedarray_type type;
+    if (napi_get_typedarray_info(env, val, &type, length, &bytes, nullptr, nullptr) != napi_ok) {
+      return false;
+    }
+    if (type != napi_uint8_array && type != napi_uint8_clamped_array && type != napi_int8_array) {
+      return false;
+    }
+  } else if (napi_is_arraybuffer(env, val, &is_binary) == napi_ok && is_binary) {
+    if (napi_get_arraybuffer_info(env, val, &bytes, length) != napi_ok) {
+      return false;
     }
+  } else {
+    return false;
   }
 
-  return object;
+  *data = static_cast<const char*>(bytes);
+  return true;
 }
 
-ddwaf_object* to_ddwaf_object_object(
+// Binary data is passed to the WAF as a single string holding the raw bytes, truncated like any other string
+ddwaf_object* to_ddwaf_binary(
   ddwaf_object *object,
-  Napi::Env env,
-  Napi::Object obj,
-  int depth,
-  bool lim,
-  bool ignoreToJSON,
-  JsSet stack,
+  const char* data,
+  size_t length,
+  const ConversionLimits *limits,
+  Arena *arena,
   WAFTruncationMetrics* metrics
 ) {
-  if (!ignoreToJSON) {
-    Napi::Value toJSON = obj.Get("toJSON");
-    if (toJSON.IsFunction()) {
-      Napi::Value toJSONResult = toJSON.As<Napi::Function>().Call(obj, {});
-      if (env.IsExceptionPending()) {
+  size_t copied = limits ? std::min(length, static_cast<size_t>(limits->max_string_length)) : length;
+  char* str = arena->copy_string(data, copied);
+  if (str == nullptr) {
+    return ddwaf_object_invalid(object);
+  }
+  if (metrics) {
+    metrics->converted_bytes += copied;
+    if (copied < length) {
+      metrics->max_truncated_string_length = std::max(metrics->max_truncated_string_length, length);
+      metrics->truncated_strings++;
+    }
+  }
+  return ddwaf_object_stringl_nc(object, str, copied);
+}
+
+
+namespace {
+
+// The first entries of a container are converted under the handle scope of the container, the following ones under
+// a scope that is reset every ENTRIES_PER_SCOPE entries so that wide containers do not keep all of their handles alive
+constexpr uint32_t ENTRIES_PER_SCOPE = 64;
+
+// frames kept inline, the containers of addresses given a larger maxContainerDepth get theirs from the heap
+constexpr size_t INLINE_FRAMES = DDWAF_MAX_CONTAINER_DEPTH;
+
+void clear_pending_exception(napi_env env) {
+  bool pending = false;
+  if (napi_is_exception_pending(env, &pending) == napi_ok && pending) {
+    napi_value exception;
+    napi_get_and_clear_last_exception(env, &exception);
+  }
+}
+
+// Converts JS values without native recursion: the containers being filled are kept on an explicit stack of frames.
+// Every container is also pushed on the ObjectStack for cycle detection. The conversion limits bound the frame count.
+// Each container is converted under its own handle scope, closed as soon as its last entry is converted.
+class ObjectConverter {
+ public:
+  ObjectConverter(napi_env env, ObjectStack* stack, Arena* arena, WAFTruncationMetrics* metrics,
+                  ConversionBudget* budget)
+    : _env(env), _stack(stack), _arena(arena), _metrics(metrics), _budget(budget), _size(0) {}
+
+  ddwaf_object* convert(ddwaf_object* object, napi_value val, int depth, const ConversionLimits* limits,
+                        bool ignoreToJSON) {
+    ddwaf_object* result = this->value(object, val, depth, limits, ignoreToJSON);
+    this->drain();
+    return result;
+  }
+
+  // The entries of the address map of a payload go through filter
+  ddwaf_object* convert_payload(ddwaf_object* object, napi_value payload, const ConversionLimits* limits,
+                                AddressFilter* filter) {
+    // the address map itself is never serialized through toJSON, its values are
+    this->_stack->Push(payload);
+    ddwaf_object* result = this->container(object, payload, false, 1, limits, filter);
+    this->drain();
+    return result;
+  }
+
+ private:
+  struct Frame {
+    // array or map being filled, its entries are allocated up front
+    ddwaf_object* object;
+    napi_value value;
+    // keys of a map
+    napi_value properties;
+    bool is_array;
+    uint32_t length;
+    uint32_t index;
+    // depth of the entries
+    int depth;
+    const ConversionLimits* limits;
+    // only set for the address map of a payload
+    AddressFilter* filter;
+    // ObjectStack entries to pop once done, two when the container was returned by a toJSON method
+    uint32_t pops;
+    napi_handle_scope scope;
+    napi_handle_scope batch_scope;
+    // map entry being converted by the frame above
+    const char* key;
+    size_t key_length;
+    AddressTruncationScope truncations{nullptr};
+  };
+
+  // Scalars are converted at once, containers are set up and pushed on the frame stack to be filled by drain()
+  ddwaf_object* value(ddwaf_object* object, napi_value val, int depth, const ConversionLimits* limits,
+                      bool ignoreToJSON) {
+    mlog("starting to convert an object");
+    if (this->_metrics) {
+      this->_metrics->converted_nodes++;
+    }
+    int max_depth = limits ? static_cast<int>(limits->max_container_depth) : DDWAF_MAX_CONTAINER_DEPTH;
+    if (depth >= max_depth) {
+      mlog("Max depth reached");
+      if (this->_metrics) {
+        this->_metrics->max_truncated_container_depth = std::max(this->_metrics->max_truncated_container_depth,
+                                                                 static_cast<size_t>(depth));
+        this->_metrics->truncated_depths++;
+      }
+      return ddwaf_object_map(object);
+    }
+
+    napi_valuetype type;
+    if (napi_typeof(this->_env, val, &type) != napi_ok) {
+      return ddwaf_object_invalid(object);
+    }
+
+    switch (type) {
+      case napi_null:
+        mlog("creating Null");
+        return ddwaf_object_null(object);
+      case napi_string:
+        mlog("creating String");
+        return to_ddwaf_string(object, this->_env, val, limits, this->_arena, this->_metrics);
+      case napi_number: {
+        mlog("creating Number");
+        double number = 0;
+        napi_get_value_double(this->_env, val, &number);
+
+        // Using fpclassify because NaN value does not match C++ quiet_NaN probably due to a mismatch between C++
+        // and IEEE754 standards.
+        switch (fpclassify(number)) {
+        case FP_NAN:
+          number = std::numeric_limits<double>::quiet_NaN();
+          break;
+        case FP_INFINITE:
+          number = std::numeric_limits<double>::infinity();
+          break;
+        default:
+          break;
+        }
+
+        return ddwaf_object_float(object, number);
+      }
+      case napi_boolean: {
+        mlog("creating Boolean");
+        bool boolean = false;
+        napi_get_value_bool(this->_env, val, &boolean);
+        return ddwaf_object_bool(object, boolean);
+      }
+      case napi_object:
+        return this->object(object, val, depth, limits, ignoreToJSON);
+      default:
+        // undefined, functions, symbols, bigints and externals
+        mlog("creating invalid object");
+        return ddwaf_object_invalid(object);
+    }
+  }
+
+  ddwaf_object* object(ddwaf_object* object, napi_value val, int depth, const ConversionLimits* limits,
+                       bool ignoreToJSON) {
+    const char* binary_data = nullptr;
+    size_t binary_length = 0;
+    if (get_binary_data(this->_env, val, &binary_data, &binary_length)) {
+      // checked before toJSON, Buffer.prototype.toJSON would expand every byte into an array element
+      mlog("creating String from binary data");
+      return to_ddwaf_binary(object, binary_data, binary_length, limits, this->_arena, this->_metrics);
+    }
+    if (this->_stack->Has(val)) {
+      mlog("Circular dependency")
+      return ddwaf_object_invalid(object);
+    }
+    this->_stack->Push(val);
+
+    if (!ignoreToJSON) {
+      napi_value to_json;
+      napi_valuetype to_json_type = napi_undefined;
+      if (napi_get_named_property(this->_env, val, "toJSON", &to_json) != napi_ok ||
+          napi_typeof(this->_env, to_json, &to_json_type) != napi_ok) {
         mlog("Exception pending");
-        env.GetAndClearPendingException();
+        clear_pending_exception(this->_env);
+        this->_stack->Pop();
         return ddwaf_object_invalid(object);
       }
-      return to_ddwaf_object(object, env, toJSONResult, depth, lim, true, stack, metrics);
+      if (to_json_type == napi_function) {
+        napi_value json;
+        if (napi_call_function(this->_env, val, to_json, 0, nullptr, &json) != napi_ok) {
+          mlog("Exception pending");
+          clear_pending_exception(this->_env);
+          this->_stack->Pop();
+          return ddwaf_object_invalid(object);
+        }
+
+        size_t size = this->_size;
+        ddwaf_object* result = this->value(object, json, depth + 1, limits, true);
+        if (this->_size > size) {
+          // val stays on the ObjectStack until the container returned by toJSON is converted
+          this->frame_at(this->_size - 1).pops++;
+        } else {
+          this->_stack->Pop();
+        }
+        return result;
+      }
     }
+
+    bool is_array = false;
+    napi_is_array(this->_env, val, &is_array);
+    mlog(is_array ? "creating Array" : "creating Object");
+    return this->container(object, val, is_array, depth + 1, limits, nullptr);
   }
 
-  Napi::Array properties = obj.GetPropertyNames();
-  uint32_t len = properties.Length();
-  if (lim && len > DDWAF_MAX_CONTAINER_SIZE) {
-    if (metrics) {
-      metrics->max_truncated_container_size = std::max(metrics->max_truncated_container_size,
-                                                       static_cast<size_t>(len));
+  // Called with val already pushed on the ObjectStack, it is popped here when the container has no entry to convert
+  ddwaf_object* container(ddwaf_object* object, napi_value val, bool is_array, int depth,
+                          const ConversionLimits* limits, AddressFilter* filter) {
+    if (this->_size >= INLINE_FRAMES && this->_size - INLINE_FRAMES == this->_deep_frames.size()) {
+      this->_deep_frames.emplace_back();
+    }
+
+    Frame& frame = this->frame_at(this->_size);
+    if (napi_open_handle_scope(this->_env, &frame.scope) != napi_ok) {
+      this->_stack->Pop();
+      return nullptr;
+    }
+
+    ddwaf_object* result = nullptr;
+    uint32_t length = 0;
+    if (is_array) {
+      if (napi_get_array_length(this->_env, val, &length) != napi_ok) {
+        mlog("Exception pending");
+        clear_pending_exception(this->_env);
+      } else if ((result = ddwaf_object_array(object)) == nullptr) {
+        mlog("failed to create array");
+      }
+    } else {
+      // Own, enumerable, string keys only: inherited and symbol keys are filtered out by V8 instead of being checked
+      // one by one, and integer indices come back already converted to strings.
+      napi_status status = napi_get_all_property_names(
+        this->_env, val,
+        napi_key_own_only,
+        static_cast<napi_key_filter>(napi_key_enumerable | napi_key_skip_symbols),
+        napi_key_numbers_to_strings,
+        &frame.properties);
+      if (status != napi_ok) {
+        mlog("Could not list properties");
+        clear_pending_exception(this->_env);
+        result = ddwaf_object_invalid(object);
+        length = 0;
+      } else {
+        napi_get_array_length(this->_env, frame.properties, &length);
+        if ((result = ddwaf_object_map(object)) == nullptr) {
+          mlog("failed to create map");
+        }
+      }
+    }
+
+    if (result != nullptr && result->type != DDWAF_OBJ_INVALID && limits && length > limits->max_container_size) {
+      if (this->_metrics) {
+        this->_metrics->max_truncated_container_size = std::max(this->_metrics->max_truncated_container_size,
+                                                                static_cast<size_t>(length));
+        this->_metrics->truncated_containers++;
+      }
+      // the keys past the container limit are never read
+      length = limits->max_container_size;
     }
-    len = DDWAF_MAX_CONTAINER_SIZE;
+
+    ddwaf_object* entries = nullptr;
+    if (result != nullptr && result->type != DDWAF_OBJ_INVALID && length > 0) {
+      entries = this->_arena->allocate_objects(length);
+      if (entries == nullptr) {
+        mlog("failed to allocate container entries");
+      }
+    }
+
+    if (entries == nullptr) {
+      napi_close_handle_scope(this->_env, frame.scope);
+      this->_stack->Pop();
+      return result;
+    }
+
+    object->array = entries;
+    frame.object = object;
+    frame.value = val;
+    frame.is_array = is_array;
+    frame.length = length;
+    frame.index = 0;
+    frame.depth = depth;
+    frame.limits = limits;
+    frame.filter = filter;
+    frame.pops = 1;
+    frame.batch_scope = nullptr;
+    frame.key = nullptr;
+    frame.key_length = 0;
+    frame.truncations = AddressTruncationScope(nullptr);
+    ++this->_size;
+    return object;
   }
-  if (env.IsExceptionPending()) {
-    mlog("Exception pending");
-    return nullptr;
+
+  void drain() {
+    while (this->_size > 0) {
+      Frame& frame = this->frame_at(this->_size - 1);
+      if (frame.index < frame.length && this->_budget != nullptr && this->_budget->exhausted()) {
+        mlog("Conversion budget exhausted");
+        frame.index = frame.length;
+      }
+      if (frame.index >= frame.length) {
+        this->finish();
+        continue;
+      }
+
+      if (frame.index % ENTRIES_PER_SCOPE == 0 && frame.index > 0) {
+        if (frame.batch_scope != nullptr) {
+          napi_close_handle_scope(this->_env, frame.batch_scope);
+        }
+        if (napi_open_handle_scope(this->_env, &frame.batch_scope) != napi_ok) {
+          frame.batch_scope = nullptr;
+        }
+      }
+
+      if (frame.is_array) {
+        this->next_item(&frame);
+      } else {
+        this->next_entry(&frame);
+      }
+    }
   }
 
-  ddwaf_object* map = ddwaf_object_map(object);
-  if (map == nullptr) {
-    mlog("failed to create map");
-    return nullptr;
+  void next_item(Frame* frame) {
+    ddwaf_object* entry = &frame->object->array[frame->object->nbEntries];
+    napi_value item;
+    if (napi_get_element(this->_env, frame->value, frame->index, &item) != napi_ok) {
+      mlog("Exception pending");
+      clear_pending_exception(this->_env);
+      this->end_entry(frame, nullptr);
+      return;
+    }
+
+    size_t size = this->_size;
+    ddwaf_object* result = this->value(entry, item, frame->depth, frame->limits, false);
+    if (this->_size == size) {
+      this->end_entry(frame, result);
+    }
   }
 
-  for (uint32_t i = 0; i < len; ++i) {
+  void next_entry(Frame* frame) {
     mlog("Getting properties");
-    Napi::Value keyV = properties.Get(i);
-    if (!obj.HasOwnProperty(keyV) || !keyV.IsString()) {
-      // We avoid inherited properties here.
-      // If the key is not a String, well this is weird
-      continue;
+    napi_value key_value;
+    if (napi_get_element(this->_env, frame->properties, frame->index, &key_value) != napi_ok) {
+      frame->index++;
+      return;
+    }
+
+    AddressFilter* filter = frame->filter;
+    size_t key_length = 0;
+    size_t key_full_length = 0;
+    const char* key = copy_utf8_string(this->_env, key_value, SIZE_MAX, this->_arena, &key_length, &key_full_length);
+    if (key == nullptr) {
+      // libddwaf has no use for a map entry without a key
+      mlog("Could not copy key");
+      frame->index++;
+      return;
+    }
+    if (filter != nullptr && !filter->accept_address(key, key_length)) {
+      mlog("Address filtered out");
+      this->_arena->shrink_last(const_cast<char*>(key), 0);
+      frame->index++;
+      return;
+    }
+
+    napi_value val;
+    if (napi_get_property(this->_env, frame->value, key_value, &val) != napi_ok) {
+      // most likely a throwing getter
+      mlog("Could not get property");
+      clear_pending_exception(this->_env);
+      frame->index++;
+      return;
     }
-    std::string key = keyV.ToString().Utf8Value();
-    Napi::Value valV = obj.Get(keyV);
+
+    if (filter != nullptr && !filter->accept_value(key, key_length, val)) {
+      mlog("Address value filtered out");
+      frame->index++;
+      return;
+    }
+
     mlog("Looping into ToPWArgs");
-    ddwaf_object val;
-    to_ddwaf_object(&val, env, valV, depth, lim, false, stack, metrics);
-    if (!ddwaf_object_map_addl(map, key.c_str(), key.length(), &val)) {
-      mlog("add to object failed, freeing");
-      ddwaf_object_free(&val);
+    ddwaf_object* entry = &frame->object->array[frame->object->nbEntries];
+    const ConversionLimits* limits = frame->limits;
+    frame->key = key;
+    frame->key_length = key_length;
+    frame->truncations = AddressTruncationScope(filter != nullptr ? this->_metrics : nullptr);
+    if (filter != nullptr) {
+      const ConversionLimits* address_limits = filter->address_limits(key, key_length);
+      if (address_limits != nullptr) {
+        limits = address_limits;
+      }
+    }
+
+    napi_value raw_json_body;
+    if (filter != nullptr && get_raw_json(this->_env, val, &raw_json_body)) {
+      // only the values of addresses can be raw JSON bodies, so that nested objects are not checked for the tag
+      mlog("Parsing raw JSON body");
+      to_ddwaf_raw_json(entry, this->_env, raw_json_body, frame->depth, *limits, this->_arena, this->_metrics,
+                        this->_budget);
+      this->end_entry(frame, entry);
+      return;
+    }
+
+    size_t size = this->_size;
+    ddwaf_object* result = this->value(entry, val, frame->depth, limits, false);
+    if (this->_size == size) {
+      this->end_entry(frame, result);
     }
   }
 
-  return object;
-}
+  // Called once the entry at frame->index is converted, result is null when it could not be
+  void end_entry(Frame* frame, ddwaf_object* result) {
+    ddwaf_object* entry = &frame->object->array[frame->object->nbEntries];
+    if (result == nullptr) {
+      mlog("failed to convert container entry");
+      ddwaf_object_invalid(entry);
+    }
+    if (!frame->is_array) {
+      frame->truncations.end(frame->key, frame->key_length);
+      entry->parameterName = frame->key;
+      entry->parameterNameLength = frame->key_length;
+      if (this->_metrics) {
+        this->_metrics->converted_bytes += entry->parameterNameLength;
+      }
+    }
+    frame->object->nbEntries++;
+    frame->index++;
+  }
 
-ddwaf_object* to_ddwaf_string(
-  ddwaf_object *object,
-  Napi::Value val,
-  bool lim,
-  WAFTruncationMetrics* metrics
-) {
-  std::string str = val.ToString().Utf8Value();
-  int len = str.length();
-  if (lim && len > DDWAF_MAX_STRING_LENGTH) {
-    if (metrics) {
-      metrics->max_truncated_string_length = std::max(metrics->max_truncated_string_length,
-                                                      static_cast<size_t>(len));
-    }
-    len = DDWAF_MAX_STRING_LENGTH;
+  void finish() {
+    Frame& frame = this->frame_at(--this->_size);
+    if (frame.batch_scope != nullptr) {
+      napi_close_handle_scope(this->_env, frame.batch_scope);
+    }
+    napi_close_handle_scope(this->_env, frame.scope);
+    for (uint32_t i = 0; i < frame.pops; ++i) {
+      this->_stack->Pop();
+    }
+    if (this->_size > 0) {
+      this->end_entry(&this->frame_at(this->_size - 1), frame.object);
+    }
   }
-  return ddwaf_object_stringl(object, str.c_str(), len);
-}
+
+  Frame& frame_at(size_t index) {
+    return index < INLINE_FRAMES ? this->_frames[index] : this->_deep_frames[index - INLINE_FRAMES];
+  }
+
+  napi_env _env;
+  ObjectStack* _stack;
+  Arena* _arena;
+  WAFTruncationMetrics* _metrics;
+  ConversionBudget* _budget;
+  size_t _size;
+  Frame _frames[INLINE_FRAMES];
+  // frames of the containers past the default depth, a deque keeps the references to them valid as it grows
+  std::deque<Frame> _deep_frames;
+};
+
+}  // namespace
 
 ddwaf_object* to_ddwaf_object(
   ddwaf_object *object,
   Napi::Env env,
   Napi::Value val,
   int depth,
-  bool lim,
+  const ConversionLimits *limits,
   bool ignoreToJson,
-  JsSet stack,
-  WAFTruncationMetrics* metrics
+  ObjectStack *stack,
+  Arena *arena,
+  WAFTruncationMetrics* metrics,
+  ConversionBudget *budget
 ) {
-  mlog("starting to convert an object");
-  if (depth >= DDWAF_MAX_CONTAINER_DEPTH) {
-    mlog("Max depth reached");
-    if (metrics) {
-      metrics->max_truncated_container_depth = std::max(metrics->max_truncated_container_depth,
-                                                        static_cast<size_t>(depth));
-    }
-    return ddwaf_object_map(object);
-  }
-  if (val.IsNull()) {
-    mlog("creating Null");
-    return ddwaf_object_null(object);
-  }
-  if (val.IsString()) {
-    mlog("creating String");
-    return to_ddwaf_string(object, val, lim, metrics);
-  }
-  if (val.IsNumber()) {
-    mlog("creating Number");
-    double value = val.ToNumber().DoubleValue();
-
-    // Using fpclassify because NaN value does not match C++ quiet_NaN probably due to a mismatch between C++
-    // and IEEE754 standards.
-    switch (fpclassify(value)) {
-    case FP_NAN:
-      value = std::numeric_limits<double>::quiet_NaN();
-      break;
-    case FP_INFINITE:
-      value = std::numeric_limits<double>::infinity();
-      break;
-    default:
-      break;
-    }
-
-    return ddwaf_object_float(object, value);
-  }
-  if (val.IsBoolean()) {
-    mlog("creating Boolean");
-    bool boolValue = val.ToBoolean().Value();
-    return ddwaf_object_bool(object, boolValue);
-  }
-  if (val.IsFunction()) {
-    // Special case because a function will evaluate true for both IsFunction and IsObject.
-    return ddwaf_object_invalid(object);
-  }
-  if (stack.Has(val)) {
-    mlog("Circular dependency")
-    return ddwaf_object_invalid(object);
-  }
+  ObjectConverter converter(env, stack, arena, metrics, budget);
+  return converter.convert(object, val, depth, limits, ignoreToJson);
+}
 
-  if (val.IsArray()) {
-    stack.Add(val);
-    mlog("creating Array");
-    auto result =
-      to_ddwaf_object_array(object, env, val.ToObject().As<Napi::Array>(), depth + 1, lim, ignoreToJson, stack,
-                            metrics);
-    stack.Delete(val);
-    return result;
-  }
-  if (val.IsObject()) {
-    stack.Add(val);
-    mlog("creating Object");
-    auto result = to_ddwaf_object_object(object, env, val.ToObject(), depth + 1, lim, ignoreToJson, stack, metrics);
-    stack.Delete(val);
-    return result;
+ddwaf_object* to_ddwaf_payload(
+  ddwaf_object *object,
+  Napi::Env env,
+  Napi::Object payload,
+  ObjectStack *stack,
+  Arena *arena,
+  WAFTruncationMetrics* metrics,
+  AddressFilter *filter,
+  ConversionBudget *budget
+) {
+  static const ConversionLimits default_limits;
+  ObjectConverter converter(env, stack, arena, metrics, budget);
+  if (filter == nullptr || payload.IsArray() || payload.IsFunction()) {
+    return converter.convert(object, payload, 0, &default_limits, false);
   }
-  mlog("creating invalid object");
-  return ddwaf_object_invalid(object);
+  return converter.convert_payload(object, payload, &default_limits, filter);
 }
 
-Napi::Value from_ddwaf_object(const ddwaf_object *object, Napi::Env env) {
-  DDWAF_OBJ_TYPE type = object->type;
+namespace {
 
-  Napi::Value result;
+// JS container being filled by from_ddwaf_object
+struct ResultFrame {
+  const ddwaf_object* object;
+  napi_value value;
+  uint32_t index;
+  napi_escapable_handle_scope scope;
+  napi_handle_scope batch_scope;
+};
 
-  switch (type) {
-    case DDWAF_OBJ_NULL:
-      result = env.Null();
-      break;
+bool is_container(const ddwaf_object* object) {
+  return object->type == DDWAF_OBJ_ARRAY || object->type == DDWAF_OBJ_MAP;
+}
+
+napi_value from_ddwaf_scalar(napi_env env, const ddwaf_object* object) {
+  napi_value result = nullptr;
+  napi_status status;
+
+  switch (object->type) {
     case DDWAF_OBJ_BOOL:
-      result = Napi::Boolean::New(env, object->boolean);
+      status = napi_get_boolean(env, object->boolean, &result);
       break;
     case DDWAF_OBJ_SIGNED:
-      result = Napi::Number::New(env, object->intValue);
+      status = napi_create_double(env, static_cast<double>(object->intValue), &result);
       break;
     case DDWAF_OBJ_UNSIGNED:
-      result = Napi::Number::New(env, object->uintValue);
+      status = napi_create_double(env, static_cast<double>(object->uintValue), &result);
       break;
     case DDWAF_OBJ_FLOAT:
-      result = Napi::Number::New(env, object->f64);
+      status = napi_create_double(env, object->f64, &result);
       break;
     case DDWAF_OBJ_STRING:
-      result = Napi::String::New(env, object->stringValue, object->nbEntries);
+      status = napi_create_string_utf8(env, object->stringValue, object->nbEntries, &result);
+      break;
+    default:
+      status = napi_get_null(env, &result);
       break;
-    case DDWAF_OBJ_ARRAY: {
-      Napi::Array arr = Napi::Array::New(env, object->nbEntries);
+  }
 
-      if (env.IsExceptionPending()) {
-        mlog("Exception pending");
-        return env.Null();
-      }
+  if (status != napi_ok) {
+    mlog("Exception pending");
+    clear_pending_exception(env);
+    napi_get_null(env, &result);
+  }
+  return result;
+}
 
-      for (uint32_t i = 0; i < object->nbEntries; ++i) {
-        const ddwaf_object* e = &object->array[i];
-        Napi::Value v = from_ddwaf_object(e, env);
-        arr[i] = v;
-      }
+// The container is created under its own escapable scope, from which it escapes once filled
+bool open_result_frame(napi_env env, const ddwaf_object* object, ResultFrame* frame) {
+  frame->object = object;
+  frame->index = 0;
+  frame->batch_scope = nullptr;
+  if (napi_open_escapable_handle_scope(env, &frame->scope) != napi_ok) {
+    return false;
+  }
 
-      result = arr;
-      break;
+  napi_status status = object->type == DDWAF_OBJ_ARRAY
+    ? napi_create_array_with_length(env, object->nbEntries, &frame->value)
+    : napi_create_object(env, &frame->value);
+  if (status != napi_ok) {
+    mlog("Exception pending");
+    clear_pending_exception(env);
+    napi_close_escapable_handle_scope(env, frame->scope);
+    return false;
+  }
+  return true;
+}
+
+void set_result_entry(napi_env env, ResultFrame* frame, napi_value value) {
+  if (frame->object->type == DDWAF_OBJ_ARRAY) {
+    napi_set_element(env, frame->value, frame->index, value);
+  } else {
+    const ddwaf_object* entry = &frame->object->array[frame->index];
+    napi_value key;
+    if (napi_create_string_utf8(env, entry->parameterName, entry->parameterNameLength, &key) != napi_ok) {
+      mlog("Exception pending");
+      clear_pending_exception(env);
+    } else {
+      napi_set_property(env, frame->value, key, value);
     }
-    case DDWAF_OBJ_MAP: {
-      Napi::Object obj = Napi::Object::New(env);
+  }
+  frame->index++;
+}
 
-      for (uint32_t i = 0; i < object->nbEntries; ++i) {
-        const ddwaf_object* e = &object->array[i];
-        Napi::String k = Napi::String::New(env, e->parameterName, e->parameterNameLength);
-        if (env.IsExceptionPending()) {
-          mlog("Exception pending");
+}  // namespace
+
+// Same explicit stack and per container handle scopes as the conversion of JS values, see ObjectConverter
+Napi::Value from_ddwaf_object(const ddwaf_object *object, Napi::Env env) {
+  if (!is_container(object)) {
+    return Napi::Value(env, from_ddwaf_scalar(env, object));
+  }
+
+  std::vector<ResultFrame> frames(1);
+  if (!open_result_frame(env, object, &frames.back())) {
+    return env.Null();
+  }
+
+  while (true) {
+    ResultFrame& frame = frames.back();
+    if (frame.index < frame.object->nbEntries) {
+      if (frame.index % ENTRIES_PER_SCOPE == 0 && frame.index > 0) {
+        if (frame.batch_scope != nullptr) {
+          napi_close_handle_scope(env, frame.batch_scope);
+        }
+        if (napi_open_handle_scope(env, &frame.batch_scope) != napi_ok) {
+          frame.batch_scope = nullptr;
+        }
+      }
+
+      const ddwaf_object* entry = &frame.object->array[frame.index];
+      if (is_container(entry)) {
+        ResultFrame child;
+        if (open_result_frame(env, entry, &child)) {
+          frames.push_back(child);
           continue;
         }
-        Napi::Value v = from_ddwaf_object(e, env);
-        obj.Set(k, v);
+        napi_value null_value;
+        napi_get_null(env, &null_value);
+        set_result_entry(env, &frame, null_value);
+        continue;
       }
 
-      result = obj;
-      break;
+      set_result_entry(env, &frame, from_ddwaf_scalar(env, entry));
+      continue;
     }
-    default:
-      result = env.Null();
-      break;
-  }
 
-  if (env.IsExceptionPending()) {
-    mlog("Exception pending");
-    return env.Null();
-  }
+    if (frame.batch_scope != nullptr) {
+      napi_close_handle_scope(env, frame.batch_scope);
+    }
+    napi_value result;
+    bool escaped = napi_escape_handle(env, frame.scope, frame.value, &result) == napi_ok;
+    napi_close_escapable_handle_scope(env, frame.scope);
+    if (!escaped) {
+      napi_get_null(env, &result);
+    }
+    frames.pop_back();
 
-  return result;
+    if (frames.empty()) {
+      return Napi::Value(env, result);
+    }
+    set_result_entry(env, &frames.back(), result);
+  }
 }
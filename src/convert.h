@@ -7,20 +7,133 @@
 
 #include <napi.h>
 #include <ddwaf.h>
-#include "src/jsset.h"
+
+#include <chrono>
+#include <cstdint>
+
+#include "src/object_stack.h"
+#include "src/arena.h"
 #include "src/metrics.h"
 
+// Truncation limits of a converted value, the defaults are the ones libddwaf applies
+struct ConversionLimits {
+  uint32_t max_string_length = DDWAF_MAX_STRING_LENGTH;
+  uint32_t max_container_size = DDWAF_MAX_CONTAINER_SIZE;
+  uint32_t max_container_depth = DDWAF_MAX_CONTAINER_DEPTH;
+};
+
+// Bounds the conversion of a whole run payload, on top of the per-value limits.
+// Once exhausted, containers stop taking new entries and the data converted so far is kept.
+class ConversionBudget {
+ public:
+  ConversionBudget()
+    : _has_deadline(false), _exhausted(false), _over_size(false), _nodes_since_check(0), _metrics(nullptr),
+      _max_nodes(SIZE_MAX), _max_bytes(SIZE_MAX) {}
+
+  void set_deadline(std::chrono::steady_clock::time_point deadline) {
+    this->_deadline = deadline;
+    this->_has_deadline = true;
+  }
+
+  // Caps the nodes and bytes counted in metrics, 0 for no cap. A single string can still go past max_bytes.
+  void set_size_limits(const WAFTruncationMetrics* metrics, size_t max_nodes, size_t max_bytes) {
+    this->_metrics = metrics;
+    this->_max_nodes = max_nodes > 0 ? max_nodes : SIZE_MAX;
+    this->_max_bytes = max_bytes > 0 ? max_bytes : SIZE_MAX;
+  }
+
+  // Called before each container entry, the clock is only read every CLOCK_CHECK_INTERVAL calls
+  bool exhausted() {
+    if (this->_exhausted) {
+      return true;
+    }
+    if (this->_metrics != nullptr && (this->_metrics->converted_nodes >= this->_max_nodes ||
+                                      this->_metrics->converted_bytes >= this->_max_bytes)) {
+      this->_exhausted = true;
+      this->_over_size = true;
+    } else if (this->_has_deadline && ++this->_nodes_since_check >= CLOCK_CHECK_INTERVAL) {
+      this->_nodes_since_check = 0;
+      this->_exhausted = std::chrono::steady_clock::now() >= this->_deadline;
+    }
+    return this->_exhausted;
+  }
+
+  bool timed_out() const {
+    return this->_exhausted && !this->_over_size;
+  }
+
+  bool over_size() const {
+    return this->_over_size;
+  }
+
+ private:
+  static constexpr uint32_t CLOCK_CHECK_INTERVAL = 64;
+
+  std::chrono::steady_clock::time_point _deadline;
+  bool _has_deadline;
+  bool _exhausted;
+  bool _over_size;
+  uint32_t _nodes_since_check;
+  const WAFTruncationMetrics* _metrics;
+  size_t _max_nodes;
+  size_t _max_bytes;
+};
+
+// Without limits, strings and containers are kept whole and only the default depth applies
 ddwaf_object* to_ddwaf_object(
   ddwaf_object *object,
   Napi::Env env,
   Napi::Value val,
   int depth,
-  bool lim,
+  const ConversionLimits *limits,
   bool ignoreToJson,
-  JsSet stack,
-  WAFTruncationMetrics *metrics
+  ObjectStack *stack,
+  Arena *arena,
+  WAFTruncationMetrics *metrics,
+  ConversionBudget *budget = nullptr
 );
 
+// Hooks deciding which top-level addresses of a run payload get converted
+class AddressFilter {
+ public:
+  virtual ~AddressFilter() = default;
+
+  // Called before the value of an address is read, returning false skips the address entirely
+  virtual bool accept_address(const char* address, size_t length) {
+    return true;
+  }
+
+  // Called with the value of an accepted address, returning false skips its conversion
+  virtual bool accept_value(const char* address, size_t length, napi_value value) {
+    return true;
+  }
+
+  // Called instead of accept_value for the addresses of an encoded payload, see encoded_payload.h
+  virtual bool accept_encoded_value(const char* address, size_t length) {
+    return true;
+  }
+
+  // Limits of the value of an accepted address, null to keep the ones of the payload
+  virtual const ConversionLimits* address_limits(const char* address, size_t length) {
+    return nullptr;
+  }
+};
+
+// Converts the address map of a persistent or ephemeral payload, filter may be null
+ddwaf_object* to_ddwaf_payload(
+  ddwaf_object *object,
+  Napi::Env env,
+  Napi::Object payload,
+  ObjectStack *stack,
+  Arena *arena,
+  WAFTruncationMetrics *metrics,
+  AddressFilter *filter,
+  ConversionBudget *budget
+);
+
+// Reads the bytes of a byte-sized TypedArray (including Buffer) or of an ArrayBuffer in place
+bool get_binary_data(napi_env env, napi_value val, const char** data, size_t* length);
+
 Napi::Value from_ddwaf_object(const ddwaf_object *object, Napi::Env env);
 
 #endif  // SRC_CONVERT_H_
@@ -0,0 +1,111 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+
+#ifndef SRC_COUNTERS_H_
+#define SRC_COUNTERS_H_
+
+#include <napi.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "src/metrics.h"
+
+// Index of each counter in WAFCounters::values, and in the BigUint64Array exposed as DDWAF#counters
+enum WAFCounter : size_t {
+  COUNTER_RUNS,
+  COUNTER_MATCHES,
+  COUNTER_TIMEOUTS,
+  COUNTER_ERRORS,
+  COUNTER_CONVERSION_NS,
+  COUNTER_WAF_NS,
+  COUNTER_CONVERTED_NODES,
+  COUNTER_CONVERTED_BYTES,
+  COUNTER_TRUNCATED_STRINGS,
+  COUNTER_TRUNCATED_CONTAINERS,
+  COUNTER_TRUNCATED_DEPTHS,
+  COUNTER_SKIPPED_ADDRESSES,
+  COUNTER_CONVERSION_TIMEOUTS,
+  COUNTER_CACHE_HITS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_CONVERSIONS_OVER_BUDGET,
+  COUNTER_DEGRADED_RUNS,
+  COUNTER_SKIPPED_RUNS,
+  COUNTER_COUNT
+};
+
+// Exposed as DDWAF.counterNames, in WAFCounter order
+constexpr const char* COUNTER_NAMES[COUNTER_COUNT] = {
+  "runs",
+  "matches",
+  "timeouts",
+  "errors",
+  "conversionNs",
+  "wafNs",
+  "convertedNodes",
+  "convertedBytes",
+  "truncatedStrings",
+  "truncatedContainers",
+  "truncatedDepths",
+  "skippedAddresses",
+  "conversionTimeouts",
+  "cacheHits",
+  "cacheMisses",
+  "conversionsOverBudget",
+  "degradedRuns",
+  "skippedRuns",
+};
+
+// Cumulative counters of a DDWAF instance and of every context it created. The block is shared with the contexts
+// and with the JS typed array viewing it, so it lives as long as any of them. Counters are only updated from the
+// JS thread, runAsync reports its numbers once back on it.
+struct WAFCounters {
+  uint64_t values[COUNTER_COUNT] = {};
+
+  void add(WAFCounter counter, uint64_t value) {
+    this->values[counter] += value;
+  }
+
+  void add_conversion(const WAFTruncationMetrics& metrics) {
+    this->values[COUNTER_CONVERSION_NS] += metrics.conversion_duration;
+    this->values[COUNTER_CONVERTED_NODES] += metrics.converted_nodes;
+    this->values[COUNTER_CONVERTED_BYTES] += metrics.converted_bytes;
+    this->values[COUNTER_TRUNCATED_STRINGS] += metrics.truncated_strings;
+    this->values[COUNTER_TRUNCATED_CONTAINERS] += metrics.truncated_containers;
+    this->values[COUNTER_TRUNCATED_DEPTHS] += metrics.truncated_depths;
+    this->values[COUNTER_SKIPPED_ADDRESSES] += metrics.skipped_addresses;
+    this->values[COUNTER_CONVERSION_TIMEOUTS] += metrics.conversion_timeout ? 1 : 0;
+    this->values[COUNTER_CONVERSIONS_OVER_BUDGET] += metrics.conversion_over_budget ? 1 : 0;
+    this->values[COUNTER_DEGRADED_RUNS] += metrics.overload_degraded ? 1 : 0;
+    this->values[COUNTER_SKIPPED_RUNS] += metrics.overload_skipped ? 1 : 0;
+  }
+
+  // Returns a BigUint64Array reading the counters in place
+  static Napi::Value View(Napi::Env env, std::shared_ptr<WAFCounters> counters) {
+    auto owner = new std::shared_ptr<WAFCounters>(counters);
+    Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(
+      env,
+      counters->values,
+      sizeof(counters->values),
+      [](Napi::Env, void*, std::shared_ptr<WAFCounters>* owner) {
+        delete owner;
+      },
+      owner);
+    return Napi::BigUint64Array::New(env, COUNTER_COUNT, buffer, 0);
+  }
+
+  static Napi::Value Names(Napi::Env env) {
+    Napi::Array names = Napi::Array::New(env, COUNTER_COUNT);
+    for (uint32_t i = 0; i < COUNTER_COUNT; ++i) {
+      names.Set(i, Napi::String::New(env, COUNTER_NAMES[i]));
+    }
+    // shared by every caller, as the readonly type says
+    napi_object_freeze(env, names);
+    return names;
+  }
+};
+
+#endif  // SRC_COUNTERS_H_
@@ -0,0 +1,339 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+#include <ddwaf.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "src/encoded_payload.h"
+#include "src/log.h"
+
+namespace {
+
+class Decoder {
+ public:
+  Decoder(const char* data, size_t length, Arena* arena, WAFTruncationMetrics* metrics, ConversionBudget* budget)
+    : _data(data), _end(data + length), _limits(&_default_limits), _arena(arena), _metrics(metrics), _budget(budget),
+      _stopped(false) {}
+
+  bool header() {
+    const char* magic = nullptr;
+    uint8_t version = 0;
+    return this->read_bytes(3, &magic) && memcmp(magic, "DDW", 3) == 0 &&
+      this->read(&version) && version == ENCODED_PAYLOAD_VERSION;
+  }
+
+  bool root(ddwaf_object* object, AddressFilter* filter) {
+    uint8_t tag = 0;
+    if (!this->read(&tag) || tag != ENCODED_MAP) {
+      return false;
+    }
+    // same depth as the address map of a JS payload, nothing may follow it unless decoding was cut short
+    return this->container(object, tag, 1, filter) && (this->_stopped || this->_data == this->_end);
+  }
+
+ private:
+  template <typename T>
+  bool read(T* value) {
+    if (static_cast<size_t>(this->_end - this->_data) < sizeof(T)) {
+      return false;
+    }
+    memcpy(value, this->_data, sizeof(T));
+    this->_data += sizeof(T);
+    return true;
+  }
+
+  bool read_bytes(uint32_t length, const char** bytes) {
+    if (static_cast<size_t>(this->_end - this->_data) < length) {
+      return false;
+    }
+    *bytes = this->_data;
+    this->_data += length;
+    return true;
+  }
+
+  bool value(ddwaf_object* object, int depth) {
+    if (this->_metrics) {
+      this->_metrics->converted_nodes++;
+    }
+    if (depth >= static_cast<int>(this->_limits->max_container_depth)) {
+      mlog("Max depth reached");
+      if (this->_metrics) {
+        this->_metrics->max_truncated_container_depth = std::max(this->_metrics->max_truncated_container_depth,
+                                                                 static_cast<size_t>(depth));
+        this->_metrics->truncated_depths++;
+      }
+      ddwaf_object_map(object);
+      return this->skip(1, false);
+    }
+
+    uint8_t tag = 0;
+    if (!this->read(&tag)) {
+      return false;
+    }
+
+    switch (tag) {
+      case ENCODED_NULL:
+        ddwaf_object_null(object);
+        return true;
+      case ENCODED_FALSE:
+      case ENCODED_TRUE:
+        ddwaf_object_bool(object, tag == ENCODED_TRUE);
+        return true;
+      case ENCODED_SIGNED: {
+        int64_t value = 0;
+        if (!this->read(&value)) {
+          return false;
+        }
+        ddwaf_object_signed(object, value);
+        return true;
+      }
+      case ENCODED_UNSIGNED: {
+        uint64_t value = 0;
+        if (!this->read(&value)) {
+          return false;
+        }
+        ddwaf_object_unsigned(object, value);
+        return true;
+      }
+      case ENCODED_FLOAT: {
+        double value = 0;
+        if (!this->read(&value)) {
+          return false;
+        }
+        ddwaf_object_float(object, value);
+        return true;
+      }
+      case ENCODED_STRING:
+        return this->string(object);
+      case ENCODED_ARRAY:
+      case ENCODED_MAP:
+        return this->container(object, tag, depth + 1, nullptr);
+      default:
+        mlog("Unknown tag in encoded payload");
+        return false;
+    }
+  }
+
+  bool string(ddwaf_object* object) {
+    uint32_t length = 0;
+    const char* bytes = nullptr;
+    if (!this->read(&length) || !this->read_bytes(length, &bytes)) {
+      return false;
+    }
+    size_t copied = std::min(static_cast<size_t>(length), static_cast<size_t>(this->_limits->max_string_length));
+    char* str = this->_arena->copy_string(bytes, copied);
+    if (str == nullptr) {
+      ddwaf_object_invalid(object);
+      return true;
+    }
+    if (this->_metrics) {
+      this->_metrics->converted_bytes += copied;
+      if (copied < length) {
+        this->_metrics->max_truncated_string_length = std::max(this->_metrics->max_truncated_string_length,
+                                                               static_cast<size_t>(length));
+        this->_metrics->truncated_strings++;
+      }
+    }
+    ddwaf_object_stringl_nc(object, str, copied);
+    return true;
+  }
+
+  // Entries are decoded at depth, filter is only given for the address map
+  bool container(ddwaf_object* object, uint8_t tag, int depth, AddressFilter* filter) {
+    bool keyed = tag == ENCODED_MAP;
+    uint32_t count = 0;
+    if (!this->read(&count)) {
+      return false;
+    }
+    if (keyed) {
+      ddwaf_object_map(object);
+    } else {
+      ddwaf_object_array(object);
+    }
+
+    uint32_t kept = count;
+    if (kept > this->_limits->max_container_size) {
+      if (this->_metrics) {
+        this->_metrics->max_truncated_container_size = std::max(this->_metrics->max_truncated_container_size,
+                                                                static_cast<size_t>(count));
+        this->_metrics->truncated_containers++;
+      }
+      kept = this->_limits->max_container_size;
+    }
+    // every entry takes at least one byte, a larger count can only come from a corrupted payload
+    if (kept > static_cast<size_t>(this->_end - this->_data)) {
+      return false;
+    }
+    if (kept == 0) {
+      return this->skip(count, keyed);
+    }
+
+    ddwaf_object* entries = this->_arena->allocate_objects(kept);
+    if (entries == nullptr) {
+      mlog("failed to allocate container entries");
+      return false;
+    }
+    object->array = entries;
+
+    for (uint32_t i = 0; i < kept; ++i) {
+      if (this->_stopped || (this->_budget != nullptr && this->_budget->exhausted())) {
+        // the rest of the payload is dropped, there is no need to read it
+        mlog("Conversion budget exhausted");
+        this->_stopped = true;
+        return true;
+      }
+
+      const char* key = nullptr;
+      uint32_t key_length = 0;
+      if (keyed && (!this->read(&key_length) || !this->read_bytes(key_length, &key))) {
+        return false;
+      }
+
+      if (filter != nullptr && !filter->accept_encoded_value(key, key_length)) {
+        mlog("Address filtered out");
+        const char* start = this->_data;
+        if (!this->skip(1, false)) {
+          return false;
+        }
+        if (this->_metrics) {
+          this->_metrics->skipped_bytes += static_cast<size_t>(this->_data - start);
+        }
+        continue;
+      }
+
+      const char* name = nullptr;
+      if (keyed && (name = this->_arena->copy_string(key, key_length)) == nullptr) {
+        // libddwaf has no use for a map entry without a key
+        mlog("Could not copy key");
+        if (!this->skip(1, false)) {
+          return false;
+        }
+        continue;
+      }
+
+      ddwaf_object* entry = &entries[object->nbEntries];
+      if (filter != nullptr) {
+        if (!this->address_value(entry, depth, filter, key, key_length)) {
+          return false;
+        }
+      } else if (!this->value(entry, depth)) {
+        return false;
+      }
+      if (keyed) {
+        entry->parameterName = name;
+        entry->parameterNameLength = key_length;
+        if (this->_metrics) {
+          this->_metrics->converted_bytes += key_length;
+        }
+      }
+      object->nbEntries++;
+    }
+
+    return this->_stopped || this->skip(count - kept, keyed);
+  }
+
+  // Decodes the value of an address with the limits the filter gives for it
+  bool address_value(ddwaf_object* object, int depth, AddressFilter* filter, const char* address, uint32_t length) {
+    const ConversionLimits* payload_limits = this->_limits;
+    const ConversionLimits* address_limits = filter->address_limits(address, length);
+    if (address_limits != nullptr) {
+      this->_limits = address_limits;
+    }
+    AddressTruncationScope truncations(this->_metrics);
+    bool decoded = this->value(object, depth);
+    truncations.end(address, length);
+    this->_limits = payload_limits;
+    return decoded;
+  }
+
+  // Moves past count values without building them. Nesting is tracked on the heap, so arbitrarily deep payloads
+  // cannot overflow the native stack.
+  bool skip(uint32_t count, bool keyed) {
+    // values left to skip in each open container, and whether they are preceded by a key
+    std::vector<std::pair<uint32_t, bool>> open;
+    open.emplace_back(count, keyed);
+
+    while (!open.empty()) {
+      if (open.back().first == 0) {
+        open.pop_back();
+        continue;
+      }
+      open.back().first--;
+
+      const char* bytes = nullptr;
+      uint32_t length = 0;
+      if (open.back().second && (!this->read(&length) || !this->read_bytes(length, &bytes))) {
+        return false;
+      }
+
+      uint8_t tag = 0;
+      if (!this->read(&tag)) {
+        return false;
+      }
+      switch (tag) {
+        case ENCODED_NULL:
+        case ENCODED_FALSE:
+        case ENCODED_TRUE:
+          break;
+        case ENCODED_SIGNED:
+        case ENCODED_UNSIGNED:
+        case ENCODED_FLOAT:
+          if (!this->read_bytes(8, &bytes)) {
+            return false;
+          }
+          break;
+        case ENCODED_STRING:
+          if (!this->read(&length) || !this->read_bytes(length, &bytes)) {
+            return false;
+          }
+          break;
+        case ENCODED_ARRAY:
+        case ENCODED_MAP:
+          if (!this->read(&length)) {
+            return false;
+          }
+          open.emplace_back(length, tag == ENCODED_MAP);
+          break;
+        default:
+          return false;
+      }
+    }
+
+    return true;
+  }
+
+  const char* _data;
+  const char* _end;
+  const ConversionLimits _default_limits;
+  const ConversionLimits* _limits;
+  Arena* _arena;
+  WAFTruncationMetrics* _metrics;
+  ConversionBudget* _budget;
+  bool _stopped;
+};
+
+}  // namespace
+
+bool from_encoded_payload(
+  ddwaf_object *object,
+  const char* data,
+  size_t length,
+  Arena *arena,
+  WAFTruncationMetrics *metrics,
+  AddressFilter *filter,
+  ConversionBudget *budget
+) {
+  Decoder decoder(data, length, arena, metrics, budget);
+  if (!decoder.header() || !decoder.root(object, filter)) {
+    mlog("Invalid encoded payload");
+    ddwaf_object_invalid(object);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,67 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+#ifndef SRC_ENCODED_PAYLOAD_H_
+#define SRC_ENCODED_PAYLOAD_H_
+
+#include <ddwaf.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "src/arena.h"
+#include "src/convert.h"
+#include "src/metrics.h"
+
+// Encoded payloads
+//
+// The persistent and ephemeral fields of a run() payload can be given as an ArrayBuffer or a Uint8Array holding
+// the address map pre-serialized in the format below, instead of a JS object. encodePayload() in index.js produces
+// it from JS, other native code can write it directly. It is decoded without any call into JS.
+//
+// All integers are little-endian.
+//
+//   payload := 'D' 'D' 'W' version:u8 value      the version is 1, the value must be a map ending the data
+//   value   := 0x00                              null
+//            | 0x01 | 0x02                       false, true
+//            | 0x03 i64                          signed integer
+//            | 0x04 u64                          unsigned integer
+//            | 0x05 f64                          float
+//            | 0x06 length:u32 bytes             string, UTF-8 or raw bytes
+//            | 0x07 count:u32 value*             array
+//            | 0x08 count:u32 (length:u32 bytes value)*   map, each value preceded by its key
+//
+// The limits of JS payloads apply: strings are truncated to DDWAF_MAX_STRING_LENGTH bytes, containers to
+// DDWAF_MAX_CONTAINER_SIZE entries and nesting to DDWAF_MAX_CONTAINER_DEPTH unless the filter gives other limits
+// for an address, with the same metrics reported.
+
+constexpr uint8_t ENCODED_PAYLOAD_VERSION = 1;
+
+enum EncodedTag : uint8_t {
+  ENCODED_NULL = 0x00,
+  ENCODED_FALSE = 0x01,
+  ENCODED_TRUE = 0x02,
+  ENCODED_SIGNED = 0x03,
+  ENCODED_UNSIGNED = 0x04,
+  ENCODED_FLOAT = 0x05,
+  ENCODED_STRING = 0x06,
+  ENCODED_ARRAY = 0x07,
+  ENCODED_MAP = 0x08
+};
+
+// Decodes an encoded address map into object, filter may be null and is asked through accept_address(),
+// accept_encoded_value() and address_limits() which addresses to keep and how to limit them.
+// Returns false when the data is not a well-formed payload or has bytes past its address map, object is then left
+// invalid.
+bool from_encoded_payload(
+  ddwaf_object *object,
+  const char* data,
+  size_t length,
+  Arena *arena,
+  WAFTruncationMetrics *metrics,
+  AddressFilter *filter,
+  ConversionBudget *budget
+);
+
+#endif  // SRC_ENCODED_PAYLOAD_H_
@@ -8,12 +8,19 @@
 #include <stdio.h>
 #include <ddwaf.h>
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
-#include "src/alloca.h"
 #include "src/main.h"
 #include "src/log.h"
 #include "src/convert.h"
+#include "src/encoded_payload.h"
+#include "src/raw_json.h"
 
 // libddwaf result field name constants
 constexpr size_t EVENTS_LEN = 6;
@@ -23,18 +30,46 @@ constexpr size_t KEEP_LEN = 4;
 constexpr size_t DURATION_LEN = 8;
 constexpr size_t TIMEOUT_LEN = 7;
 
+// highest values accepted in addressLimits
+constexpr uint32_t MAX_STRING_LENGTH_LIMIT = 16 * 1024 * 1024;
+constexpr uint32_t MAX_CONTAINER_SIZE_LIMIT = 1024 * 1024;
+constexpr uint32_t MAX_CONTAINER_DEPTH_LIMIT = 256;
+
+// identifies the externals DDWAF.attach() passes to the constructor
+static const napi_type_tag SHARED_HANDLE_TAG = { 0x6464776166736861ULL, 0x72656468616e646cULL };
+
+// true when value is an external created by DDWAF.attach(), and only then holds a std::shared_ptr<SharedHandle>*
+static bool is_shared_handle(napi_env env, napi_value value) {
+  napi_valuetype type;
+  bool tagged = false;
+  return napi_typeof(env, value, &type) == napi_ok && type == napi_external &&
+    napi_check_object_type_tag(env, value, &SHARED_HANDLE_TAG, &tagged) == napi_ok && tagged;
+}
+
 Napi::Object DDWAF::Init(Napi::Env env, Napi::Object exports) {
   mlog("Setting up class DDWAF");
   Napi::Function func = DefineClass(env, "DDWAF", {
     StaticMethod<&DDWAF::version>("version"),
+    StaticMethod<&DDWAF::attach>("attach"),
+    StaticMethod<&DDWAF::raw_json>("rawJson"),
+    InstanceMethod<&DDWAF::share>("share"),
     InstanceMethod<&DDWAF::update_config>("createOrUpdateConfig"),
     InstanceMethod<&DDWAF::remove_config>("removeConfig"),
+    InstanceMethod<&DDWAF::apply_configs>("applyConfigs"),
+    InstanceMethod<&DDWAF::update_config_async>("createOrUpdateConfigAsync"),
+    InstanceMethod<&DDWAF::remove_config_async>("removeConfigAsync"),
     InstanceAccessor("configPaths", &DDWAF::GetConfigPaths, nullptr, napi_enumerable),
+    InstanceAccessor("diagnostics", &DDWAF::GetDiagnostics, nullptr, napi_enumerable),
+    InstanceAccessor("diagnosticsSummary", &DDWAF::GetDiagnosticsSummary, nullptr, napi_enumerable),
+    InstanceMethod<&DDWAF::get_config_diagnostics>("getConfigDiagnostics"),
+    InstanceAccessor("overload", &DDWAF::GetOverload, nullptr, napi_enumerable),
     InstanceMethod<&DDWAF::createContext>("createContext"),
     InstanceMethod<&DDWAF::dispose>("dispose"),
     InstanceAccessor("disposed", &DDWAF::GetDisposed, nullptr, napi_enumerable),
+    StaticValue("counterNames", WAFCounters::Names(env), napi_enumerable),
     // TODO(simon-id): should we have an InstanceValue for rulesInfo and requiredAddresses here ?
   });
+  env.GetInstanceData<AddonData>()->waf_constructor = Napi::Persistent(func);
   exports.Set("DDWAF", func);
   return exports;
 }
@@ -44,6 +79,16 @@ Napi::Value DDWAF::version(const Napi::CallbackInfo& info) {
   return Napi::String::New(info.Env(), ddwaf_get_version());
 }
 
+Napi::Value DDWAF::raw_json(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  Napi::Value raw_json = info.Length() > 0 ? make_raw_json(env, info[0]) : Napi::Value();
+  if (raw_json.IsEmpty()) {
+    Napi::TypeError::New(env, "First argument must be a string or a Buffer").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  return raw_json;
+}
+
 Napi::Value DDWAF::GetDisposed(const Napi::CallbackInfo& info) {
   return Napi::Boolean::New(info.Env(), this->_disposed);
 }
@@ -51,6 +96,25 @@ Napi::Value DDWAF::GetDisposed(const Napi::CallbackInfo& info) {
 DDWAF::DDWAF(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DDWAF>(info) {
   Napi::Env env = info.Env();
   size_t arg_len = info.Length();
+
+  if (arg_len >= 1 && is_shared_handle(env, info[0])) {
+    // DDWAF.attach(), externals from other addons are not tagged and are rejected as any non-object argument
+    std::shared_ptr<SharedHandle>* shared = info[0].As<Napi::External<std::shared_ptr<SharedHandle>>>().Data();
+
+    if (arg_len >= 2 && !info[1].IsUndefined()) {
+      if (!info[1].IsObject()) {
+        Napi::TypeError::New(env, "Second argument must be an object").ThrowAsJavaScriptException();
+        return;
+      }
+      if (!this->parse_options(env, info[1].ToObject())) {
+        return;
+      }
+    }
+
+    this->init_instance(env, *shared);
+    return;
+  }
+
   if (arg_len < 2) {
     Napi::Error::New(env, "Wrong number of arguments, expected at least 2").ThrowAsJavaScriptException();
     return;
@@ -66,7 +130,8 @@ DDWAF::DDWAF(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DDWAF>(info) {
     return;
   }
 
-  ddwaf_config waf_config{{0, 0, 0}, {nullptr, nullptr}, ddwaf_object_free};
+  // no free_fn: the data passed to ddwaf_run lives in the arenas of each DDWAFContext
+  ddwaf_config waf_config{{0, 0, 0}, {nullptr, nullptr}, nullptr};
 
   // do not touch these strings after the c_str() assigment
   std::string key_regex_str;
@@ -104,11 +169,30 @@ DDWAF::DDWAF(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DDWAF>(info) {
       value_regex_str = value_regex.ToString().Utf8Value();
       waf_config.obfuscator.value_regex = value_regex_str.c_str();
     }
+
+    if (!this->parse_options(env, config)) {
+      return;
+    }
+  }
+
+  if (this->_options.address_limits) {
+    // libddwaf applies a single set of limits to every address, it must not cut what addressLimits allows
+    ConversionLimits widest;
+    for (const auto& entry : *this->_options.address_limits) {
+      widest.max_string_length = std::max(widest.max_string_length, entry.second.max_string_length);
+      widest.max_container_size = std::max(widest.max_container_size, entry.second.max_container_size);
+      widest.max_container_depth = std::max(widest.max_container_depth, entry.second.max_container_depth);
+    }
+    waf_config.limits.max_string_length = widest.max_string_length;
+    waf_config.limits.max_container_size = widest.max_container_size;
+    waf_config.limits.max_container_depth = widest.max_container_depth;
   }
 
   ddwaf_object rules;
+  ObjectStack stack(env);
+  Arena arena;
   mlog("building rules");
-  to_ddwaf_object(&rules, env, info[0], 0, false, false, JsSet::Create(env), nullptr);
+  to_ddwaf_object(&rules, env, info[0], 0, nullptr, false, &stack, &arena, nullptr);
   std::string config_path = info[1].As<Napi::String>().Utf8Value();
 
   ddwaf_object diagnostics;
@@ -117,12 +201,7 @@ DDWAF::DDWAF(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DDWAF>(info) {
   ddwaf_builder builder = ddwaf_builder_init(&waf_config);
   bool result = ddwaf_builder_add_or_update_config(builder, LSTRARG(config_path.c_str()), &rules, &diagnostics);
 
-  ddwaf_object_free(&rules);
-
-  Napi::Value diagnostics_js = from_ddwaf_object(&diagnostics, env);
-  info.This().As<Napi::Object>().Set("diagnostics", diagnostics_js);
-
-  ddwaf_object_free(&diagnostics);
+  this->store_diagnostics(config_path, &diagnostics);
 
   if (!result) {
     Napi::Error::New(env, "Invalid rules").ThrowAsJavaScriptException();
@@ -137,12 +216,252 @@ DDWAF::DDWAF(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DDWAF>(info) {
     return;
   }
 
-  this->_builder = builder;
-  this->_handle = handle;
+  this->init_instance(env, std::make_shared<SharedHandle>(builder, handle));
+}
+
+// Options that only affect this instance and its contexts, attached instances parse their own
+bool DDWAF::parse_options(Napi::Env env, Napi::Object config) {
+  if (config.Has("memoizePersistent")) {
+    Napi::Value memoize_persistent = config.Get("memoizePersistent");
+
+    if (!memoize_persistent.IsBoolean()) {
+      Napi::TypeError::New(env, "memoizePersistent must be a boolean").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    this->_options.memoize_persistent = memoize_persistent.ToBoolean().Value();
+  }
+
+  if (config.Has("lazyResults")) {
+    Napi::Value lazy_results = config.Get("lazyResults");
+
+    if (!lazy_results.IsBoolean()) {
+      Napi::TypeError::New(env, "lazyResults must be a boolean").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    this->_options.lazy_results = lazy_results.ToBoolean().Value();
+  }
+
+  if (config.Has("contextPoolSize")) {
+    Napi::Value context_pool_size = config.Get("contextPoolSize");
+
+    if (!context_pool_size.IsNumber() || !(context_pool_size.ToNumber().DoubleValue() >= 1)) {
+      Napi::TypeError::New(env, "contextPoolSize must be a positive number").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    this->_options.context_pool_size = context_pool_size.ToNumber().Uint32Value();
+  }
+
+  if (config.Has("verdictCacheSize")) {
+    Napi::Value verdict_cache_size = config.Get("verdictCacheSize");
+
+    if (!verdict_cache_size.IsNumber() || verdict_cache_size.ToNumber().DoubleValue() < 0) {
+      Napi::TypeError::New(env, "verdictCacheSize must be a positive number").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    this->_options.verdict_cache_size = verdict_cache_size.ToNumber().Uint32Value();
+  }
+
+  if (config.Has("addressLimits")) {
+    Napi::Value address_limits = config.Get("addressLimits");
+
+    if (!address_limits.IsObject() || address_limits.IsArray()) {
+      Napi::TypeError::New(env, "addressLimits must be an object").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    auto limits = std::make_shared<AddressLimits>();
+    Napi::Array addresses = address_limits.As<Napi::Object>().GetPropertyNames();
+    for (uint32_t i = 0; i < addresses.Length(); ++i) {
+      Napi::Value address = addresses.Get(i);
+      Napi::Value address_config = address_limits.As<Napi::Object>().Get(address);
+
+      if (!address_config.IsObject()) {
+        Napi::TypeError::New(env, "addressLimits values must be objects").ThrowAsJavaScriptException();
+        return false;
+      }
+
+      ConversionLimits& entry = (*limits)[address.ToString().Utf8Value()];
+      Napi::Object limits = address_config.As<Napi::Object>();
+      if (!read_limit(env, limits, "maxStringLength", MAX_STRING_LENGTH_LIMIT, &entry.max_string_length) ||
+          !read_limit(env, limits, "maxContainerSize", MAX_CONTAINER_SIZE_LIMIT, &entry.max_container_size) ||
+          !read_limit(env, limits, "maxContainerDepth", MAX_CONTAINER_DEPTH_LIMIT, &entry.max_container_depth)) {
+        return false;
+      }
+    }
+
+    this->_options.address_limits = limits;
+  }
+
+  if (config.Has("maxConvertedNodes")) {
+    Napi::Value max_converted_nodes = config.Get("maxConvertedNodes");
+
+    if (!max_converted_nodes.IsNumber() || max_converted_nodes.ToNumber().DoubleValue() < 0) {
+      Napi::TypeError::New(env, "maxConvertedNodes must be a positive number").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    this->_options.max_converted_nodes = static_cast<size_t>(max_converted_nodes.ToNumber().Int64Value());
+  }
+
+  if (config.Has("maxConvertedBytes")) {
+    Napi::Value max_converted_bytes = config.Get("maxConvertedBytes");
+
+    if (!max_converted_bytes.IsNumber() || max_converted_bytes.ToNumber().DoubleValue() < 0) {
+      Napi::TypeError::New(env, "maxConvertedBytes must be a positive number").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    this->_options.max_converted_bytes = static_cast<size_t>(max_converted_bytes.ToNumber().Int64Value());
+  }
+
+  if (config.Has("overload")) {
+    Napi::Value overload = config.Get("overload");
+
+    if (!overload.IsObject()) {
+      Napi::TypeError::New(env, "overload must be an object").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    Napi::Value cpu_budget = overload.As<Napi::Object>().Get("cpuBudget");
+
+    if (!cpu_budget.IsNumber() || cpu_budget.ToNumber().DoubleValue() <= 0) {
+      Napi::TypeError::New(env, "cpuBudget must be a positive number").ThrowAsJavaScriptException();
+      return false;
+    }
+
+    // given in µs per second, like the run timeouts
+    this->_options.overload_budget_ns = static_cast<uint64_t>(cpu_budget.ToNumber().DoubleValue() * 1000);
+
+    if (overload.As<Napi::Object>().Has("lagThreshold")) {
+      Napi::Value lag_threshold = overload.As<Napi::Object>().Get("lagThreshold");
+
+      if (!lag_threshold.IsNumber() || lag_threshold.ToNumber().DoubleValue() < 0) {
+        Napi::TypeError::New(env, "lagThreshold must be a positive number").ThrowAsJavaScriptException();
+        return false;
+      }
+
+      // given in ms
+      this->_options.overload_lag_threshold_ns =
+        static_cast<uint64_t>(lag_threshold.ToNumber().DoubleValue() * 1000000);
+    }
+
+    auto degraded_addresses = std::make_shared<AddressSet>();
+    if (overload.As<Napi::Object>().Has("degradedAddresses")) {
+      Napi::Value addresses = overload.As<Napi::Object>().Get("degradedAddresses");
+
+      if (!addresses.IsArray()) {
+        Napi::TypeError::New(env, "degradedAddresses must be an array of strings").ThrowAsJavaScriptException();
+        return false;
+      }
+
+      Napi::Array list = addresses.As<Napi::Array>();
+      for (uint32_t i = 0; i < list.Length(); ++i) {
+        Napi::Value address = list.Get(i);
+        if (!address.IsString()) {
+          Napi::TypeError::New(env, "degradedAddresses must be an array of strings").ThrowAsJavaScriptException();
+          return false;
+        }
+        degraded_addresses->insert(address.As<Napi::String>().Utf8Value());
+      }
+    } else {
+      // the request headers, and what libddwaf derives from them
+      degraded_addresses->insert({
+        "server.request.headers.no_cookies",
+        "server.request.cookies",
+        "http.client_ip"
+      });
+    }
+    this->_options.degraded_addresses = degraded_addresses;
+  }
+
+  return true;
+}
+
+// Reads one of the limits of an addressLimits entry, the missing ones keep their default. The limits size the
+// buffers of a conversion and bound the nesting of the native parsers, so they cannot go past max.
+bool DDWAF::read_limit(Napi::Env env, Napi::Object config, const char* name, uint32_t max, uint32_t* value) {
+  if (!config.Has(name)) {
+    return true;
+  }
+
+  Napi::Value limit = config.Get(name);
+  double number = limit.IsNumber() ? limit.ToNumber().DoubleValue() : 0;
+
+  if (!(number >= 1)) {
+    Napi::TypeError::New(env, std::string(name) + " must be a positive number").ThrowAsJavaScriptException();
+    return false;
+  }
+
+  if (number > max) {
+    Napi::TypeError::New(env, std::string(name) + " must not be above " + std::to_string(max))
+      .ThrowAsJavaScriptException();
+    return false;
+  }
+
+  *value = static_cast<uint32_t>(number);
+  return true;
+}
+
+void DDWAF::init_instance(Napi::Env env, std::shared_ptr<SharedHandle> shared) {
+  this->_shared = shared;
   this->_disposed = false;
 
-  this->update_known_addresses(info);
-  this->update_known_actions(info);
+  this->_counters = std::make_shared<WAFCounters>();
+  this->Value().Set("counters", WAFCounters::View(env, this->_counters));
+
+  this->refresh_known(env);
+
+  if (this->_options.context_pool_size > 0) {
+    this->_context_pool = std::make_shared<ContextPool>(this->_options.context_pool_size);
+  }
+
+  if (this->_options.verdict_cache_size > 0) {
+    this->_verdict_cache = std::make_shared<VerdictCache>(this->_options.verdict_cache_size);
+  }
+
+  if (this->_options.overload_budget_ns > 0) {
+    uv_loop_t* loop = nullptr;
+    napi_get_uv_event_loop(env, &loop);
+    this->_overload = std::make_shared<OverloadGuard>(this->_options.overload_budget_ns,
+                                                      this->_options.overload_lag_threshold_ns, loop);
+  }
+}
+
+Napi::Value DDWAF::share(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (this->_disposed) {
+    Napi::Error::New(env, "Calling share on a disposed DDWAF instance").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  return Napi::Number::New(env, SharedHandle::Share(this->_shared));
+}
+
+Napi::Value DDWAF::attach(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsNumber()) {
+    Napi::TypeError::New(env, "First argument must be a number").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  std::shared_ptr<SharedHandle> shared = SharedHandle::Attach(info[0].ToNumber().Uint32Value());
+  if (!shared) {
+    Napi::Error::New(env, "No DDWAF instance shared with this id").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  Napi::Value config = info.Length() >= 2 ? info[1] : env.Undefined();
+
+  auto external = Napi::External<std::shared_ptr<SharedHandle>>::New(env, &shared);
+  napi_type_tag_object(env, external, &SHARED_HANDLE_TAG);
+
+  return env.GetInstanceData<AddonData>()->waf_constructor.New({ external, config });
 }
 
 void DDWAF::Finalize(Napi::Env env) {
@@ -150,9 +469,28 @@ void DDWAF::Finalize(Napi::Env env) {
   if (this->_disposed) {
     return;
   }
-  ddwaf_destroy(this->_handle);
-  ddwaf_builder_destroy(this->_builder);
   this->_disposed = true;
+  if (!this->_config_queue.empty()) {
+    // the builder is in use on the threadpool, complete_config will destroy the instance
+    mlog("deferring DDWAF destruction until the pending config update completes");
+    return;
+  }
+  this->destroy();
+}
+
+void DDWAF::destroy() {
+  // the ruleset is destroyed with the last instance using it
+  this->_shared.reset();
+  this->_known_address_set.reset();
+  if (this->_context_pool) {
+    this->_context_pool->close();
+    this->_context_pool.reset();
+  }
+  this->_verdict_cache.reset();
+  this->_overload.reset();
+  this->_config_diagnostics.clear();
+  this->_last_diagnostics.reset();
+  this->_diagnostics_js.Reset();
 }
 
 void DDWAF::dispose(const Napi::CallbackInfo& info) {
@@ -185,43 +523,45 @@ Napi::Value DDWAF::update_config(const Napi::CallbackInfo& info) {
     return env.Undefined();
   }
 
+  if (!this->_config_queue.empty()) {
+    Napi::Error::New(env, "Calling createOrUpdateConfig with a pending config update").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
   ddwaf_object update;
+  ObjectStack stack(env);
+  Arena arena;
   mlog("Building config update");
-  to_ddwaf_object(&update, env, info[0], 0, false, false, JsSet::Create(env), nullptr);
+  to_ddwaf_object(&update, env, info[0], 0, nullptr, false, &stack, &arena, nullptr);
 
   mlog("Obtaining config update path");
   std::string config_path = info[1].As<Napi::String>().Utf8Value();
 
   ddwaf_object diagnostics;
+  bool update_result;
+  {
+    // blocks while an attached instance updates the config, which holds the lock for one build at most
+    std::lock_guard<std::mutex> lock(this->_shared->builder_mutex());
+
+    mlog("Applying new config to builder");
+    update_result = ddwaf_builder_add_or_update_config(
+      this->_shared->builder(),
+      LSTRARG(config_path.c_str()),
+      &update, &diagnostics);
+
+    if (update_result) {
+      this->build_instance();
+    }
+  }
 
-  mlog("Applying new config to builder");
-  bool update_result = ddwaf_builder_add_or_update_config(
-    this->_builder,
-    LSTRARG(config_path.c_str()),
-    &update, &diagnostics);
-
-  Napi::Value diagnostics_js = from_ddwaf_object(&diagnostics, env);
-  info.This().As<Napi::Object>().Set("diagnostics", diagnostics_js);
-
-  ddwaf_object_free(&diagnostics);
+  this->store_diagnostics(config_path, &diagnostics);
 
   if (!update_result) {
     mlog("DDWAF Builder update config has failed");
     return Napi::Boolean::New(env, false);
   }
 
-  mlog("Update DDWAF instance");
-  ddwaf_handle updated_handle = ddwaf_builder_build_instance(this->_builder);
-  ddwaf_object_free(&update);
-
-  if (updated_handle != nullptr) {
-    mlog("New DDWAF updated instance")
-    ddwaf_destroy(this->_handle);
-    this->_handle = updated_handle;
-
-    this->update_known_addresses(info);
-    this->update_known_actions(info);
-  }
+  this->refresh_known(env);
 
   return Napi::Boolean::New(env, true);
 }
@@ -246,230 +586,1484 @@ Napi::Value DDWAF::remove_config(const Napi::CallbackInfo& info) {
     return env.Undefined();
   }
 
+  if (!this->_config_queue.empty()) {
+    Napi::Error::New(env, "Calling removeConfig with a pending config update").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
   mlog("Obtaining config remove path");
   std::string config_path = info[0].As<Napi::String>().Utf8Value();
 
-  mlog("Applying removed config to builder");
-  bool remove_result = ddwaf_builder_remove_config(this->_builder, LSTRARG(config_path.c_str()));
+  bool remove_result;
+  {
+    std::lock_guard<std::mutex> lock(this->_shared->builder_mutex());
+
+    mlog("Applying removed config to builder");
+    remove_result = ddwaf_builder_remove_config(this->_shared->builder(), LSTRARG(config_path.c_str()));
+
+    if (remove_result) {
+      this->build_instance();
+    }
+  }
 
   if (!remove_result) {
     mlog("DDWAF Builder remove config has failed");
     return Napi::Boolean::New(env, false);
   }
 
-  mlog("Update DDWAF instance");
-  ddwaf_handle updated_handle = ddwaf_builder_build_instance(this->_builder);
-
-  if (updated_handle != nullptr) {
-    mlog("New DDWAF updated instance")
-    ddwaf_destroy(this->_handle);
-    this->_handle = updated_handle;
-
-    this->update_known_addresses(info);
-    this->update_known_actions(info);
-  }
+  this->_config_diagnostics.erase(config_path);
+  this->refresh_known(env);
 
   return Napi::Boolean::New(env, true);
 }
 
-Napi::Value DDWAF::GetConfigPaths(const Napi::CallbackInfo& info) {
+// Applies a list of { path, config } operations, an operation without config removes its path, and builds the
+// instance once for the whole batch. Arguments are validated before the builder is touched, operations that the
+// builder rejects do not prevent the others from being applied.
+Napi::Value DDWAF::apply_configs(const Napi::CallbackInfo& info) {
+  mlog("Calling apply configs on DDWAF");
+
   Napi::Env env = info.Env();
 
   if (this->_disposed) {
-    return Napi::Array::New(env, 0);
+    Napi::Error::New(env, "Could not update a disposed WAF instance").ThrowAsJavaScriptException();
+    return env.Undefined();
   }
 
-  ddwaf_object config_paths;
-  ddwaf_builder_get_config_paths(this->_builder, &config_paths, nullptr, 0);
+  if (info.Length() < 1) {
+    Napi::Error::New(env, "Wrong number of arguments, expected at least 1").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
 
-  Napi::Value config_paths_js = from_ddwaf_object(&config_paths, env);
+  if (!info[0].IsArray()) {
+    Napi::TypeError::New(env, "First argument must be an array").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
 
-  ddwaf_object_free(&config_paths);
+  if (!this->_config_queue.empty()) {
+    Napi::Error::New(env, "Calling applyConfigs with a pending config update").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
 
-  return config_paths_js;
-}
+  Napi::Array operations = info[0].As<Napi::Array>();
+  uint32_t length = operations.Length();
 
-void DDWAF::update_known_addresses(const Napi::CallbackInfo& info) {
-  Napi::Env env = info.Env();
+  for (uint32_t i = 0; i < length; ++i) {
+    Napi::Value operation = operations.Get(i);
+    if (!operation.IsObject() || !operation.As<Napi::Object>().Get("path").IsString()) {
+      Napi::TypeError::New(env, "Each operation must be an object with a string path").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
 
-  uint32_t size = 0;
-  const char* const* known_addresses = ddwaf_known_addresses(this->_handle, &size);
+    Napi::Value config = operation.As<Napi::Object>().Get("config");
+    if (!config.IsUndefined() && !config.IsObject()) {
+      Napi::TypeError::New(env, "Operation config must be an object").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+  }
 
-  Napi::Value set = env.RunScript("new Set()");
-  Napi::Function set_add = set.As<Napi::Object>().Get("add").As<Napi::Function>();
+  // every config is converted before the builder is locked, which is never held while calling into JS
+  std::vector<std::string> paths(length);
+  std::vector<ddwaf_object> updates(length);
+  std::vector<bool> removals(length);
 
-  for (uint32_t i = 0; i < size; ++i) {
-    Napi::String address = Napi::String::New(env, known_addresses[i]);
-    set_add.Call(set, {address});
-  }
+  ObjectStack stack(env);
+  Arena arena;
 
-  info.This().As<Napi::Object>().Set("knownAddresses", set);
-}
+  for (uint32_t i = 0; i < length; ++i) {
+    Napi::Object operation = operations.Get(i).As<Napi::Object>();
+    Napi::Value config = operation.Get("config");
+    paths[i] = operation.Get("path").As<Napi::String>().Utf8Value();
+    removals[i] = config.IsUndefined();
 
-void DDWAF::update_known_actions(const Napi::CallbackInfo& info) {
-  Napi::Env env = info.Env();
+    if (!removals[i]) {
+      mlog("Building config update");
+      to_ddwaf_object(&updates[i], env, config, 0, nullptr, false, &stack, &arena, nullptr);
+    }
+  }
 
-  uint32_t size = 0;
-  const char* const* known_actions = ddwaf_known_actions(this->_handle, &size);
+  std::vector<ddwaf_object> diagnostics(length);
+  std::vector<bool> successes(length);
+  bool updated = false;
+  {
+    std::lock_guard<std::mutex> lock(this->_shared->builder_mutex());
+
+    ddwaf_builder builder = this->_shared->builder();
+
+    for (uint32_t i = 0; i < length; ++i) {
+      if (removals[i]) {
+        mlog("Applying removed config to builder");
+        successes[i] = ddwaf_builder_remove_config(builder, LSTRARG(paths[i].c_str()));
+      } else {
+        mlog("Applying new config to builder");
+        successes[i] = ddwaf_builder_add_or_update_config(
+          builder,
+          LSTRARG(paths[i].c_str()),
+          &updates[i], &diagnostics[i]);
+      }
 
-  Napi::Value set = env.RunScript("new Set()");
-  Napi::Function set_add = set.As<Napi::Object>().Get("add").As<Napi::Function>();
+      updated = updated || successes[i];
+    }
 
-  for (uint32_t i = 0; i < size; ++i) {
-    Napi::String address = Napi::String::New(env, known_actions[i]);
-    set_add.Call(set, {address});
+    if (updated) {
+      this->build_instance();
+    }
   }
 
-  info.This().As<Napi::Object>().Set("knownActions", set);
-}
+  Napi::Array results = Napi::Array::New(env, length);
 
-Napi::Value DDWAF::createContext(const Napi::CallbackInfo& info) {
-  Napi::Env env = info.Env();
-  if (this->_disposed) {
-    Napi::Error::New(env, "Calling createContext on a disposed DDWAF instance").ThrowAsJavaScriptException();
-    return env.Null();
-  }
-  mlog("Create context");
-  Napi::Object context = env.GetInstanceData<Napi::FunctionReference>()->New({});
-  DDWAFContext* raw = Napi::ObjectWrap<DDWAFContext>::Unwrap(context);
-  if (!raw->init(this->_handle)) {
-    Napi::Error::New(env, "Could not create context").ThrowAsJavaScriptException();
-    return env.Null();
-  }
-  return context;
-}
+  for (uint32_t i = 0; i < length; ++i) {
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("path", operations.Get(i).As<Napi::Object>().Get("path"));
 
-DDWAFContext::DDWAFContext(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DDWAFContext>(info) {
-  this->_disposed = false;
-}
+    if (removals[i]) {
+      if (successes[i]) {
+        this->_config_diagnostics.erase(paths[i]);
+      }
+    } else {
+      // returned to the caller, so converted right away
+      result.Set("diagnostics", from_ddwaf_object(&diagnostics[i], env));
+      this->store_diagnostics(paths[i], &diagnostics[i]);
+    }
 
-bool DDWAFContext::init(ddwaf_handle handle) {
-  ddwaf_context context = ddwaf_context_init(handle);
-  if (context == nullptr) {
-    return false;
+    result.Set("success", Napi::Boolean::New(env, successes[i]));
+    results.Set(i, result);
   }
-  this->_context = context;
-  return true;
-}
 
-void DDWAFContext::Finalize(Napi::Env env) {
-  mlog("calling finalize on context");
-  if (this->_disposed) {
-    return;
+  if (updated) {
+    this->refresh_known(env);
   }
-  ddwaf_context_destroy(this->_context);
-  this->_disposed = true;
-}
 
-void DDWAFContext::dispose(const Napi::CallbackInfo& info) {
-  mlog("calling dispose on context");
-  return this->Finalize(info.Env());
+  return results;
 }
 
-Napi::Value DDWAFContext::run(const Napi::CallbackInfo& info) {
+Napi::Value DDWAF::GetConfigPaths(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
 
   if (this->_disposed) {
-    Napi::Error::New(env, "Calling run on a disposed context").ThrowAsJavaScriptException();
-    return env.Null();
+    return Napi::Array::New(env, 0);
   }
 
-  if (info.Length() < 2) {  // payload, timeout
-    Napi::Error::New(env, "Wrong number of arguments, 2 expected").ThrowAsJavaScriptException();
-    return env.Null();
+  if (!this->_config_queue.empty()) {
+    Napi::Error::New(env, "Reading configPaths with a pending config update").ThrowAsJavaScriptException();
+    return env.Undefined();
   }
 
-  if (!info[0].IsObject()) {
-    Napi::TypeError::New(
-            env,
-            "Payload data must be an object")
-        .ThrowAsJavaScriptException();
-    return env.Null();
+  ddwaf_object config_paths;
+  {
+    std::lock_guard<std::mutex> lock(this->_shared->builder_mutex());
+    ddwaf_builder_get_config_paths(this->_shared->builder(), &config_paths, nullptr, 0);
   }
 
-  Napi::Object payload = info[0].As<Napi::Object>();
-  Napi::Value persistent = payload.Get("persistent");
-  Napi::Value ephemeral = payload.Get("ephemeral");
+  Napi::Value config_paths_js = from_ddwaf_object(&config_paths, env);
 
-  if (!persistent.IsObject() && !ephemeral.IsObject()) {
-    Napi::TypeError::New(env, "Persistent or ephemeral must be an object").ThrowAsJavaScriptException();
-    return env.Null();
-  }
+  ddwaf_object_free(&config_paths);
 
-  if (!info[1].IsNumber()) {
-    Napi::TypeError::New(env, "Timeout argument must be a number").ThrowAsJavaScriptException();
-    return env.Null();
-  }
+  return config_paths_js;
+}
+
+// Takes ownership of the diagnostics of an update of path, they are only converted when read
+void DDWAF::store_diagnostics(const std::string& path, ddwaf_object* diagnostics) {
+  std::shared_ptr<ddwaf_object> stored(new ddwaf_object(*diagnostics), [](ddwaf_object* object) {
+    ddwaf_object_free(object);
+    delete object;
+  });
+  this->_config_diagnostics[path] = stored;
+  this->_last_diagnostics = stored;
+  this->_diagnostics_js.Reset();
+}
+
+// Diagnostics of the last config update, converted on first read
+Napi::Value DDWAF::GetDiagnostics(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!this->_last_diagnostics) {
+    return env.Undefined();
+  }
+
+  if (this->_diagnostics_js.IsEmpty()) {
+    this->_diagnostics_js = Napi::Persistent(from_ddwaf_object(this->_last_diagnostics.get(), env));
+  }
+  return this->_diagnostics_js.Value();
+}
+
+// Counts of the ids and messages of every section of the last diagnostics, read without converting them
+Napi::Value DDWAF::GetDiagnosticsSummary(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!this->_last_diagnostics) {
+    return env.Undefined();
+  }
+
+  uint32_t loaded = 0;
+  uint32_t failed = 0;
+  uint32_t skipped = 0;
+  uint32_t errors = 0;
+  uint32_t warnings = 0;
+  Napi::Value ruleset_version = env.Undefined();
+
+  const ddwaf_object* diagnostics = this->_last_diagnostics.get();
+  for (size_t i = 0; i < ddwaf_object_size(diagnostics); ++i) {
+    const ddwaf_object* section = ddwaf_object_get_index(diagnostics, i);
+    size_t length = 0;
+    const char* key = ddwaf_object_get_key(section, &length);
+    if (key == nullptr) {
+      continue;
+    }
+
+    if (ddwaf_object_type(section) == DDWAF_OBJ_STRING && std::string(key, length) == "ruleset_version") {
+      size_t version_length = 0;
+      const char* version = ddwaf_object_get_string(section, &version_length);
+      ruleset_version = Napi::String::New(env, version, version_length);
+      continue;
+    }
+
+    for (size_t j = 0; j < ddwaf_object_size(section); ++j) {
+      const ddwaf_object* field = ddwaf_object_get_index(section, j);
+      const char* name = ddwaf_object_get_key(field, &length);
+      if (name == nullptr) {
+        continue;
+      }
+
+      std::string field_name(name, length);
+      uint32_t size = static_cast<uint32_t>(ddwaf_object_size(field));
+      if (field_name == "loaded") {
+        loaded += size;
+      } else if (field_name == "failed") {
+        failed += size;
+      } else if (field_name == "skipped") {
+        skipped += size;
+      } else if (field_name == "errors") {
+        errors += size;
+      } else if (field_name == "warnings") {
+        warnings += size;
+      } else if (field_name == "error") {
+        // the whole section could not be parsed
+        errors++;
+      }
+    }
+  }
+
+  Napi::Object summary = Napi::Object::New(env);
+  if (!ruleset_version.IsUndefined()) {
+    summary.Set("rulesetVersion", ruleset_version);
+  }
+  summary.Set("loaded", Napi::Number::New(env, loaded));
+  summary.Set("failed", Napi::Number::New(env, failed));
+  summary.Set("skipped", Napi::Number::New(env, skipped));
+  summary.Set("errors", Napi::Number::New(env, errors));
+  summary.Set("warnings", Napi::Number::New(env, warnings));
+  return summary;
+}
+
+// Diagnostics of the last update of a config path, undefined once the path is removed or if it was never updated
+Napi::Value DDWAF::get_config_diagnostics(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsString()) {
+    Napi::TypeError::New(env, "First argument must be a string").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  auto it = this->_config_diagnostics.find(info[0].As<Napi::String>().Utf8Value());
+  if (it == this->_config_diagnostics.end()) {
+    return env.Undefined();
+  }
+  return from_ddwaf_object(it->second.get(), env);
+}
+
+// State of the overload protection, null when it is disabled. Times are in µs like the run timeouts.
+Napi::Value DDWAF::GetOverload(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!this->_overload) {
+    return env.Null();
+  }
+
+  Napi::Object overload = Napi::Object::New(env);
+  overload.Set("remainingBudget", Napi::Number::New(env, static_cast<double>(this->_overload->tokens()) / 1000));
+  overload.Set("averageRunCost", Napi::Number::New(env, static_cast<double>(this->_overload->average_cost()) / 1000));
+  overload.Set("averageLoopLag", Napi::Number::New(env, static_cast<double>(this->_overload->average_lag()) / 1000));
+  return overload;
+}
+
+// Builds the instance from the builder and swaps it in, must be called with the builder mutex held
+void DDWAF::build_instance() {
+  mlog("Update DDWAF instance");
+  ddwaf_handle updated_handle = ddwaf_builder_build_instance(this->_shared->builder());
+
+  if (updated_handle != nullptr) {
+    mlog("New DDWAF updated instance")
+    this->_shared->swap(updated_handle);
+  }
+}
+
+// Rebuilds knownAddresses and knownActions if the shared handle changed since they were last built, which also
+// happens when the handle was updated through another instance attached to it
+void DDWAF::refresh_known(Napi::Env env) {
+  KnownNames known;
+  bool stale = this->_shared->with_handle([&](ddwaf_handle handle, uint64_t generation) {
+    return this->read_known(handle, generation, &known);
+  });
+  if (stale) {
+    this->publish_known(env, &known);
+  }
+}
+
+// Copies the names known by the handle unless they were already published, the JS sets are only built by
+// publish_known() once the handle mutex is released
+bool DDWAF::read_known(ddwaf_handle handle, uint64_t generation, KnownNames* known) {
+  if (this->_known_address_set && this->_generation == generation) {
+    return false;
+  }
+
+  uint32_t size = 0;
+  const char* const* known_addresses = ddwaf_known_addresses(handle, &size);
+  known->addresses.assign(known_addresses, known_addresses + size);
+
+  // contexts keep the set of the handle they were created from
+  auto known_address_set = std::make_shared<AddressSet>();
+  known_address_set->reserve(size);
+  for (uint32_t i = 0; i < size; ++i) {
+    known_address_set->emplace(known_addresses[i]);
+  }
+  known->address_set = known_address_set;
+
+  const char* const* known_actions = ddwaf_known_actions(handle, &size);
+  known->actions.assign(known_actions, known_actions + size);
+
+  known->generation = generation;
+  return true;
+}
+
+void DDWAF::publish_known(Napi::Env env, KnownNames* known) {
+  Napi::Value address_set = env.RunScript("new Set()");
+  Napi::Function address_set_add = address_set.As<Napi::Object>().Get("add").As<Napi::Function>();
+  for (const std::string& address : known->addresses) {
+    address_set_add.Call(address_set, {Napi::String::New(env, address)});
+  }
+
+  Napi::Value action_set = env.RunScript("new Set()");
+  Napi::Function action_set_add = action_set.As<Napi::Object>().Get("add").As<Napi::Function>();
+  for (const std::string& action : known->actions) {
+    action_set_add.Call(action_set, {Napi::String::New(env, action)});
+  }
+
+  this->Value().Set("knownAddresses", address_set);
+  this->Value().Set("knownActions", action_set);
+  this->_known_address_set = known->address_set;
+  this->_generation = known->generation;
+}
+
+// Applies a config update or removal to the builder, builds the new instance and swaps it on the threadpool.
+// The workers of a DDWAF instance run one at a time, in the order they were created, and the sync config methods
+// of the instance are refused while any is pending. knownAddresses and knownActions are refreshed on the JS thread.
+class DDWAFConfigWorker : public Napi::AsyncWorker {
+ public:
+  DDWAFConfigWorker(Napi::Env env, DDWAF* waf, Napi::Object receiver, std::shared_ptr<SharedHandle> shared,
+                    const std::string& path, const char* name)
+    : Napi::AsyncWorker(env, name),
+      _deferred(Napi::Promise::Deferred::New(env)),
+      _waf(waf),
+      _receiver(Napi::Persistent(receiver)),
+      _shared(shared),
+      _path(path),
+      _remove(true),
+      _applied(false),
+      _has_diagnostics(false) {}
+
+  // Turns the worker into an update, the config is converted here since it needs the JS thread
+  void SetConfig(Napi::Env env, Napi::Value config) {
+    ObjectStack stack(env);
+    to_ddwaf_object(&this->_config, env, config, 0, nullptr, false, &stack, &this->_arena, nullptr);
+    this->_remove = false;
+  }
+
+  Napi::Promise Promise() const {
+    return this->_deferred.Promise();
+  }
+
+  void Cancel(Napi::Env env) {
+    this->_deferred.Reject(Napi::Error::New(env, "DDWAF instance disposed before the config update").Value());
+  }
+
+  bool applied() const {
+    return this->_applied;
+  }
+
+  bool removal() const {
+    return this->_remove;
+  }
+
+  const std::string& path() const {
+    return this->_path;
+  }
+
+  ddwaf_object* diagnostics() {
+    return this->_has_diagnostics ? &this->_diagnostics : nullptr;
+  }
+
+ protected:
+  void Execute() override {
+    std::lock_guard<std::mutex> lock(this->_shared->builder_mutex());
+    ddwaf_builder builder = this->_shared->builder();
+
+    if (this->_remove) {
+      this->_applied = ddwaf_builder_remove_config(builder, LSTRARG(this->_path.c_str()));
+    } else {
+      this->_applied = ddwaf_builder_add_or_update_config(
+        builder,
+        LSTRARG(this->_path.c_str()),
+        &this->_config, &this->_diagnostics);
+      this->_has_diagnostics = true;
+    }
+
+    if (this->_applied) {
+      ddwaf_handle handle = ddwaf_builder_build_instance(builder);
+      if (handle != nullptr) {
+        this->_shared->swap(handle);
+      }
+    }
+  }
+
+  void OnOK() override {
+    Napi::Env env = Env();
+    this->_deferred.Resolve(this->_waf->complete_config(env, this));
+  }
+
+ private:
+  Napi::Promise::Deferred _deferred;
+  DDWAF* _waf;
+  // keeps the JS instance alive, and therefore not finalized, while the builder is in use
+  Napi::ObjectReference _receiver;
+  std::shared_ptr<SharedHandle> _shared;
+  std::string _path;
+  bool _remove;
+  Arena _arena;
+  ddwaf_object _config;
+  bool _applied;
+  bool _has_diagnostics;
+  ddwaf_object _diagnostics;
+};
+
+Napi::Value DDWAF::update_config_async(const Napi::CallbackInfo& info) {
+  mlog("Calling async update config on DDWAF");
+
+  Napi::Env env = info.Env();
+
+  if (this->_disposed) {
+    Napi::Error::New(env, "Could not update a disposed WAF instance").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  if (info.Length() < 2) {
+    Napi::Error::New(env, "Wrong number of arguments, expected at least 2").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  if (!info[0].IsObject()) {
+    Napi::TypeError::New(env, "First argument must be an object").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  if (!info[1].IsString()) {
+    Napi::TypeError::New(env, "Second argument must be a string").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  std::string config_path = info[1].As<Napi::String>().Utf8Value();
+
+  DDWAFConfigWorker* worker = new DDWAFConfigWorker(env, this, info.This().As<Napi::Object>(), this->_shared,
+                                                    config_path, "DDWAF.createOrUpdateConfigAsync");
+  worker->SetConfig(env, info[0]);
+
+  return this->queue_config(worker);
+}
+
+Napi::Value DDWAF::remove_config_async(const Napi::CallbackInfo& info) {
+  mlog("Calling async remove config on DDWAF");
+
+  Napi::Env env = info.Env();
+
+  if (this->_disposed) {
+    Napi::Error::New(env, "Could not update a disposed WAF instance").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  if (info.Length() < 1) {
+    Napi::Error::New(env, "Wrong number of arguments, expected at least 1").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  if (!info[0].IsString()) {
+    Napi::TypeError::New(env, "First argument must be a string").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  std::string config_path = info[0].As<Napi::String>().Utf8Value();
+
+  DDWAFConfigWorker* worker = new DDWAFConfigWorker(env, this, info.This().As<Napi::Object>(), this->_shared,
+                                                    config_path, "DDWAF.removeConfigAsync");
+
+  return this->queue_config(worker);
+}
+
+Napi::Value DDWAF::queue_config(DDWAFConfigWorker* worker) {
+  Napi::Promise promise = worker->Promise();
+
+  this->_config_queue.push_back(worker);
+  if (this->_config_queue.size() == 1) {
+    worker->Queue();
+  }
+
+  return promise;
+}
+
+Napi::Value DDWAF::complete_config(Napi::Env env, DDWAFConfigWorker* worker) {
+  this->_config_queue.pop_front();
+
+  ddwaf_object* diagnostics = worker->diagnostics();
+  if (diagnostics != nullptr) {
+    if (!this->_disposed) {
+      this->store_diagnostics(worker->path(), diagnostics);
+    } else {
+      ddwaf_object_free(diagnostics);
+    }
+  } else if (worker->removal() && worker->applied() && !this->_disposed) {
+    this->_config_diagnostics.erase(worker->path());
+  }
+
+  if (this->_disposed) {
+    mlog("destroying DDWAF disposed during a config update");
+    for (DDWAFConfigWorker* pending : this->_config_queue) {
+      pending->Cancel(env);
+      delete pending;
+    }
+    this->_config_queue.clear();
+    this->destroy();
+    return Napi::Boolean::New(env, worker->applied());
+  }
+
+  this->refresh_known(env);
+
+  if (!this->_config_queue.empty()) {
+    this->_config_queue.front()->Queue();
+  }
+
+  return Napi::Boolean::New(env, worker->applied());
+}
+
+Napi::Value DDWAF::createContext(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (this->_disposed) {
+    Napi::Error::New(env, "Calling createContext on a disposed DDWAF instance").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  mlog("Create context");
+  Napi::Object context = env.GetInstanceData<AddonData>()->context_constructor.New({});
+  DDWAFContext* raw = Napi::ObjectWrap<DDWAFContext>::Unwrap(context);
+  KnownNames known;
+  bool stale = false;
+  bool initialized = this->_shared->with_handle([&](ddwaf_handle handle, uint64_t generation) {
+    // the known addresses given to the context must be the ones of the handle it is created from
+    stale = this->read_known(handle, generation, &known);
+    std::shared_ptr<const AddressSet> known_addresses = stale ? known.address_set : this->_known_address_set;
+
+    return raw->init(handle, this->_options, known_addresses, this->_counters, this->_context_pool,
+                     this->_verdict_cache, this->_overload, generation);
+  });
+  if (stale) {
+    this->publish_known(env, &known);
+  }
+  if (!initialized) {
+    Napi::Error::New(env, "Could not create context").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  return context;
+}
+
+DDWAFContext::DDWAFContext(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DDWAFContext>(info) {
+  this->_disposed = false;
+  this->_running = false;
+}
+
+bool DDWAFContext::init(
+  ddwaf_handle handle,
+  const DDWAFOptions& options,
+  std::shared_ptr<const AddressSet> known_addresses,
+  std::shared_ptr<WAFCounters> counters,
+  std::weak_ptr<ContextPool> pool,
+  std::shared_ptr<VerdictCache> verdict_cache,
+  std::shared_ptr<OverloadGuard> overload,
+  uint64_t generation
+) {
+  ddwaf_context context = ddwaf_context_init(handle);
+  if (context == nullptr) {
+    return false;
+  }
+  this->_context = context;
+  this->_disposed = false;
+  this->_options = options;
+  this->_known_addresses = known_addresses;
+  this->_counters = counters;
+  this->_pool = pool;
+  this->_verdict_cache = verdict_cache;
+  this->_overload = overload;
+  this->_generation = generation;
+  this->_persistent_fingerprint = 0;
+  this->_matched = false;
+  this->_verdict_cacheable = false;
+
+  std::shared_ptr<ContextPool> shared_pool = pool.lock();
+  if (shared_pool && shared_pool->acquire(&this->_persistent_arena, &this->_ephemeral_arena)) {
+    mlog("Reusing pooled arenas");
+  }
+  return true;
+}
+
+void DDWAFContext::Finalize(Napi::Env env) {
+  mlog("calling finalize on context");
+  if (this->_disposed) {
+    return;
+  }
+  this->_disposed = true;
+  if (this->_running) {
+    // ddwaf_run is still using the context on the threadpool, complete_run will destroy it
+    mlog("deferring context destruction until runAsync completes");
+    return;
+  }
+  this->destroy();
+}
+
+void DDWAFContext::destroy() {
+  if (this->_context != nullptr) {
+    ddwaf_context_destroy(this->_context);
+    this->_context = nullptr;
+  }
+  this->_persistent_arena.release();
+  this->_ephemeral_arena.release();
+  this->_persistent_memo.clear();
+  this->_known_addresses.reset();
+  this->_counters.reset();
+  this->_verdict_cache.reset();
+  this->_overload.reset();
+}
+
+// Decides which top-level addresses of a run payload are converted:
+// - addresses that are not known to the ruleset are never read by a rule and are skipped, before their value is read
+//   so that getters of the payload do not run for them
+// - runs degraded by the overload protection only keep the addresses of the degradedAddresses option
+// It also gives the conversion limits configured for an address through the addressLimits option.
+class PayloadFilter : public AddressFilter {
+ public:
+  PayloadFilter(
+    const AddressSet* known_addresses,
+    const AddressLimits* address_limits,
+    const AddressSet* degraded_addresses,
+    WAFTruncationMetrics* metrics
+  ) : _known_addresses(known_addresses), _address_limits(address_limits),
+      _degraded_addresses(degraded_addresses), _metrics(metrics) {}
+
+  bool accept_address(const char* address, size_t length) override {
+    return this->is_known(address, length) && !this->is_shed();
+  }
+
+  // Skips the address when its value is the RawJson wrapper last sent for it, see DDWAFOptions::memoize_persistent
+  bool accept_value(const char* address, size_t length, napi_value value) override {
+    if (this->_memo == nullptr) {
+      return true;
+    }
+
+    this->_address.assign(address, length);
+    auto it = this->_memo->find(this->_address);
+    if (it != this->_memo->end()) {
+      // a collected wrapper leaves the reference empty, and cannot be the value anyway
+      napi_value sent = nullptr;
+      bool equal = false;
+      if (napi_get_reference_value(this->_env, it->second, &sent) == napi_ok && sent != nullptr &&
+          napi_strict_equals(this->_env, sent, value, &equal) == napi_ok && equal) {
+        mlog("Skipping unchanged persistent address");
+        return false;
+      }
+      this->_memo->erase(it);
+    }
+
+    // the wrapper is frozen and strings are immutable, the same wrapper always parses to the same tree
+    napi_value body;
+    napi_valuetype type;
+    if (get_raw_json(this->_env, value, &body) && napi_typeof(this->_env, body, &type) == napi_ok &&
+        type == napi_string) {
+      // referenced right away, value does not outlive the handle scope of the converter
+      this->_memoizable.emplace_back(this->_address, Napi::Weak(Napi::Object(this->_env, value)));
+    }
+    return true;
+  }
+
+  // the decoder counts the bytes it skips
+  bool accept_encoded_value(const char* address, size_t length) override {
+    if (!this->is_known(address, length) || this->is_shed()) {
+      return false;
+    }
+    if (this->_memo != nullptr) {
+      this->_memo->erase(this->_address);
+    }
+    return true;
+  }
+
+  const ConversionLimits* address_limits(const char* address, size_t length) override {
+    if (this->_address_limits == nullptr) {
+      return nullptr;
+    }
+    this->_address.assign(address, length);
+    auto it = this->_address_limits->find(this->_address);
+    return it != this->_address_limits->end() ? &it->second : nullptr;
+  }
+
+  // Filters a persistent payload through memo, which only learns the wrappers sent once record_memo is called
+  void use_memo(napi_env env, PersistentMemo* memo) {
+    this->_env = env;
+    this->_memo = memo;
+  }
+
+  // Called once the payload is converted in full, a conversion cut short may not have sent the wrappers
+  void record_memo() {
+    for (auto& sent : this->_memoizable) {
+      (*this->_memo)[sent.first] = std::move(sent.second);
+    }
+  }
+
+ private:
+  // also leaves the address in _address for is_shed
+  bool is_known(const char* address, size_t length) {
+    this->_address.assign(address, length);
+
+    if (this->_known_addresses != nullptr && this->_known_addresses->count(this->_address) == 0) {
+      mlog("Skipping unknown address");
+      this->_metrics->skipped_addresses++;
+      return false;
+    }
+    return true;
+  }
+
+  // called after is_known, with the address in _address
+  bool is_shed() {
+    if (this->_degraded_addresses == nullptr || this->_degraded_addresses->count(this->_address) != 0) {
+      return false;
+    }
+    mlog("Shedding address of a degraded run");
+    this->_metrics->shed_addresses++;
+    return true;
+  }
+
+  const AddressSet* _known_addresses;
+  const AddressLimits* _address_limits;
+  const AddressSet* _degraded_addresses;
+  WAFTruncationMetrics* _metrics;
+  // reused for every lookup to avoid an allocation per address
+  std::string _address;
+  napi_env _env = nullptr;
+  PersistentMemo* _memo = nullptr;
+  // addresses accepted with a RawJson wrapper that can be memoized, and the wrapper
+  std::vector<std::pair<std::string, Napi::ObjectReference>> _memoizable;
+};
+
+void DDWAFContext::dispose(const Napi::CallbackInfo& info) {
+  mlog("calling dispose on context");
+  std::shared_ptr<ContextPool> pool = this->_pool.lock();
+  if (!pool || this->_disposed || this->_running) {
+    return this->Finalize(info.Env());
+  }
+
+  // libddwaf references the persistent data until its context is destroyed, only then can the arenas be reused
+  this->_disposed = true;
+  ddwaf_context_destroy(this->_context);
+  this->_context = nullptr;
+  this->_persistent_arena.reset();
+  this->_ephemeral_arena.reset();
+  if (pool->release(&this->_persistent_arena, &this->_ephemeral_arena)) {
+    mlog("arenas returned to the pool");
+  }
+  this->destroy();
+}
+
+// Converts the persistent or ephemeral part of a run payload, given either as an object or as an ArrayBuffer or
+// Uint8Array in the format of encoded_payload.h. Returns false when the encoded data is malformed.
+static bool convert_payload(
+  ddwaf_object* object,
+  Napi::Env env,
+  Napi::Object payload,
+  ObjectStack* stack,
+  Arena* arena,
+  WAFTruncationMetrics* metrics,
+  AddressFilter* filter,
+  ConversionBudget* budget
+) {
+  const char* data = nullptr;
+  size_t length = 0;
+  if (get_binary_data(env, payload, &data, &length)) {
+    return from_encoded_payload(object, data, length, arena, metrics, filter, budget);
+  }
+  to_ddwaf_payload(object, env, payload, stack, arena, metrics, filter, budget);
+  return true;
+}
+
+bool DDWAFContext::check_runnable(Napi::Env env) {
+  if (this->_disposed) {
+    Napi::Error::New(env, "Calling run on a disposed context").ThrowAsJavaScriptException();
+    return false;
+  }
+
+  if (this->_running) {
+    Napi::Error::New(env, "Calling run on a context with a pending runAsync").ThrowAsJavaScriptException();
+    return false;
+  }
+
+  return true;
+}
+
+// Reads the persistent and ephemeral parts of a run payload, at least one of them must be given
+static bool read_payload(Napi::Env env, Napi::Value payload, Napi::Value* persistent, Napi::Value* ephemeral) {
+  if (!payload.IsObject()) {
+    Napi::TypeError::New(
+            env,
+            "Payload data must be an object")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+
+  *persistent = payload.As<Napi::Object>().Get("persistent");
+  *ephemeral = payload.As<Napi::Object>().Get("ephemeral");
+
+  if (!persistent->IsObject() && !ephemeral->IsObject()) {
+    Napi::TypeError::New(env, "Persistent or ephemeral must be an object").ThrowAsJavaScriptException();
+    return false;
+  }
+
+  return true;
+}
+
+// Returns 0 when the timeout argument is invalid
+static int64_t read_timeout(Napi::Env env, Napi::Value value) {
+  if (!value.IsNumber()) {
+    Napi::TypeError::New(env, "Timeout argument must be a number").ThrowAsJavaScriptException();
+    return 0;
+  }
+
+  int64_t timeout = value.ToNumber().Int64Value();
+  if (timeout <= 0) {
+    Napi::TypeError::New(env, "Timeout argument must be greater than 0").ThrowAsJavaScriptException();
+    return 0;
+  }
+
+  return timeout;
+}
+
+bool DDWAFContext::prepare_run(const Napi::CallbackInfo& info, DDWAFRunInput* input) {
+  Napi::Env env = info.Env();
+
+  if (!this->check_runnable(env)) {
+    return false;
+  }
+
+  if (info.Length() < 2) {  // payload, timeout
+    Napi::Error::New(env, "Wrong number of arguments, 2 expected").ThrowAsJavaScriptException();
+    return false;
+  }
+
+  Napi::Value persistent;
+  Napi::Value ephemeral;
+  if (!read_payload(env, info[0], &persistent, &ephemeral)) {
+    return false;
+  }
+
+  int64_t timeout = read_timeout(env, info[1]);
+  if (timeout == 0) {
+    return false;
+  }
+
+  // the timeout covers the conversion of the payload as well, ddwaf_run only gets what is left of it
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout);
+  return this->convert_run_payload(env, persistent, ephemeral, deadline, input);
+}
+
+bool DDWAFContext::convert_run_payload(
+  Napi::Env env,
+  Napi::Value persistent,
+  Napi::Value ephemeral,
+  std::chrono::steady_clock::time_point deadline,
+  DDWAFRunInput* input
+) {
+  ObjectStack stack(env);
+  this->_metrics = {};
+
+  OverloadDecision overload = this->_overload ? this->_overload->decide() : OVERLOAD_NONE;
+  if (overload == OVERLOAD_SKIPPED) {
+    // the payload is dropped, persistent addresses included
+    mlog("Skipping run of an overloaded instance");
+    this->_metrics.overload_skipped = true;
+    this->_verdict_cacheable = false;
+    if (this->_counters) {
+      this->_counters->add_conversion(this->_metrics);
+    }
+    return true;
+  }
+  this->_metrics.overload_degraded = overload == OVERLOAD_DEGRADED;
+  const AddressSet* degraded_addresses =
+    this->_metrics.overload_degraded ? this->_options.degraded_addresses.get() : nullptr;
+
+  auto conversion_start = std::chrono::steady_clock::now();
+  ConversionBudget budget;
+  budget.set_deadline(deadline);
+  budget.set_size_limits(&this->_metrics, this->_options.max_converted_nodes, this->_options.max_converted_bytes);
+
+  const AddressSet* known_addresses = this->_known_addresses.get();
+  const AddressLimits* address_limits = this->_options.address_limits.get();
+
+  if (persistent.IsObject()) {
+    PayloadFilter filter(known_addresses, address_limits, degraded_addresses, &this->_metrics);
+    if (this->_options.memoize_persistent) {
+      filter.use_memo(env, &this->_persistent_memo);
+    }
+    if (!convert_payload(&input->persistent, env, persistent.As<Napi::Object>(), &stack, &this->_persistent_arena,
+                         &this->_metrics, &filter, &budget)) {
+      Napi::TypeError::New(env, "Invalid encoded persistent payload").ThrowAsJavaScriptException();
+      return false;
+    }
+    input->has_persistent = true;
+    if (this->_options.memoize_persistent && !budget.timed_out() && !budget.over_size()) {
+      // a conversion cut short by the budget is not remembered, the next run sends the address again in full
+      filter.record_memo();
+    }
+  }
+
+  if (ephemeral.IsObject()) {
+    PayloadFilter filter(known_addresses, address_limits, degraded_addresses, &this->_metrics);
+    if (!convert_payload(&input->ephemeral, env, ephemeral.As<Napi::Object>(), &stack, &this->_ephemeral_arena,
+                         &this->_metrics, &filter, &budget)) {
+      Napi::TypeError::New(env, "Invalid encoded ephemeral payload").ThrowAsJavaScriptException();
+      return false;
+    }
+    input->has_ephemeral = true;
+  }
+
+  auto conversion_end = std::chrono::steady_clock::now();
+  auto conversion_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    conversion_end - conversion_start).count();
+  this->_metrics.conversion_duration = static_cast<uint64_t>(conversion_duration);
+  this->_metrics.conversion_timeout = budget.timed_out();
+  this->_metrics.conversion_over_budget = budget.over_size();
+  if (this->_overload) {
+    this->_overload->record(this->_metrics.conversion_duration);
+  }
+
+  // ddwaf_run treats a timeout of 0 as already expired, keep at least 1µs so that it still reports a result
+  int64_t remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - conversion_end).count();
+  input->timeout = static_cast<uint64_t>(remaining > 0 ? remaining : 1);
+
+  if (this->_counters) {
+    this->_counters->add_conversion(this->_metrics);
+  }
 
-  int64_t timeout = info[1].ToNumber().Int64Value();
-  if (timeout <= 0) {
-    Napi::TypeError::New(env, "Timeout argument must be greater than 0").ThrowAsJavaScriptException();
+  this->_verdict_cacheable = false;
+  if (this->_verdict_cache) {
+    if (input->has_persistent) {
+      // verdicts depend on every persistent address the context has seen
+      this->_persistent_fingerprint = hash_object(&input->persistent, this->_persistent_fingerprint);
+    } else if (!this->_matched && !this->_metrics.conversion_timeout && !this->_metrics.conversion_over_budget) {
+      this->_verdict_payload.clear();
+      serialize_object(&input->ephemeral, &this->_verdict_payload);
+      SipHasher hasher(this->_persistent_fingerprint);
+      hasher.update(this->_verdict_payload.data(), this->_verdict_payload.size());
+      this->_verdict_key = hasher.finish();
+      this->_verdict_cacheable = true;
+    }
+  }
+
+  return true;
+}
+
+// Returns true when ddwaf_run can be skipped: the overload protection dropped the run, or its payload is known
+// not to match
+bool DDWAFContext::skip_run() {
+  if (this->_metrics.overload_skipped) {
+    return true;
+  }
+  if (!this->_verdict_cacheable) {
+    return false;
+  }
+  bool hit = this->_verdict_cache->lookup(this->_verdict_key, this->_persistent_fingerprint,
+                                          this->_verdict_payload, this->_generation);
+  if (this->_counters) {
+    this->_counters->add(hit ? COUNTER_CACHE_HITS : COUNTER_CACHE_MISSES, 1);
+  }
+  if (hit) {
+    mlog("Cached no-match verdict");
+    this->_verdict_cacheable = false;
+  }
+  return hit;
+}
+
+DDWAF_RET_CODE DDWAFContext::execute_run(DDWAFRunInput* input, ddwaf_object* result) {
+  return ddwaf_run(
+    this->_context,
+    input->has_persistent ? &input->persistent : nullptr,
+    input->has_ephemeral ? &input->ephemeral : nullptr,
+    result,
+    input->timeout);
+}
+
+Napi::Value DDWAFContext::run(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  DDWAFRunInput input;
+  if (!this->prepare_run(info, &input)) {
     return env.Null();
   }
 
-  ddwaf_object *ddwafPersistent = nullptr;
-  this->_metrics = {};
+  if (this->skip_run()) {
+    this->_ephemeral_arena.reset();
+    return this->new_result(env);
+  }
 
-  if (persistent.IsObject()) {
-    ddwafPersistent = static_cast<ddwaf_object *>(alloca(sizeof(ddwaf_object)));
-    to_ddwaf_object(ddwafPersistent, env, persistent, 0, true, false, JsSet::Create(env), &this->_metrics);
+  ddwaf_object result;
+  DDWAF_RET_CODE code = this->execute_run(&input, &result);
+  this->_ephemeral_arena.reset();
+
+  return this->build_result(env, code, &result);
+}
+
+class DDWAFRunWorker : public Napi::AsyncWorker {
+ public:
+  DDWAFRunWorker(Napi::Env env, DDWAFContext* context, Napi::Object receiver, const DDWAFRunInput& input)
+    : Napi::AsyncWorker(env, "DDWAFContext.runAsync"),
+      _deferred(Napi::Promise::Deferred::New(env)),
+      _context(context),
+      _receiver(Napi::Persistent(receiver)),
+      _input(input),
+      _code(DDWAF_ERR_INTERNAL) {}
+
+  Napi::Promise Promise() const {
+    return this->_deferred.Promise();
   }
 
-  ddwaf_object *ddwafEphemeral = nullptr;
+ protected:
+  void Execute() override {
+    this->_code = this->_context->execute_run(&this->_input, &this->_result);
+  }
 
-  if (ephemeral.IsObject()) {
-    ddwafEphemeral = static_cast<ddwaf_object *>(alloca(sizeof(ddwaf_object)));
-    to_ddwaf_object(ddwafEphemeral, env, ephemeral, 0, true, false, JsSet::Create(env), &this->_metrics);
+  void OnOK() override {
+    this->_deferred.Resolve(this->_context->complete_run(Env(), this->_code, &this->_result));
+  }
+
+ private:
+  Napi::Promise::Deferred _deferred;
+  DDWAFContext* _context;
+  // keeps the JS context alive, and therefore not finalized, while ddwaf_run is in flight
+  Napi::ObjectReference _receiver;
+  DDWAFRunInput _input;
+  DDWAF_RET_CODE _code;
+  ddwaf_object _result;
+};
+
+// Runs every payload in sequence under a single timeout. With shortCircuit, the evaluation stops at the first
+// match and only its result is built, with the index of its payload, or null is returned when nothing matched.
+Napi::Value DDWAFContext::run_batch(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!this->check_runnable(env)) {
+    return env.Null();
+  }
+
+  if (info.Length() < 2) {  // payloads, timeout
+    Napi::Error::New(env, "Wrong number of arguments, 2 expected").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (!info[0].IsArray()) {
+    Napi::TypeError::New(env, "Payloads must be an array").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  int64_t timeout = read_timeout(env, info[1]);
+  if (timeout == 0) {
+    return env.Null();
+  }
+
+  bool short_circuit = false;
+  if (info.Length() > 2 && !info[2].IsUndefined()) {
+    if (!info[2].IsBoolean()) {
+      Napi::TypeError::New(env, "shortCircuit must be a boolean").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    short_circuit = info[2].ToBoolean().Value();
+  }
+
+  // every payload is checked before the first run so that a bad one does not leave the batch half done
+  Napi::Array payloads = info[0].As<Napi::Array>();
+  uint32_t length = payloads.Length();
+  std::vector<std::pair<Napi::Value, Napi::Value>> parts(length);
+  for (uint32_t i = 0; i < length; ++i) {
+    if (!read_payload(env, payloads.Get(i), &parts[i].first, &parts[i].second)) {
+      return env.Null();
+    }
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout);
+  Napi::Array results = Napi::Array::New(env, short_circuit ? 0 : length);
+
+  for (uint32_t i = 0; i < length; ++i) {
+    DDWAFRunInput input;
+    if (!this->convert_run_payload(env, parts[i].first, parts[i].second, deadline, &input)) {
+      this->_ephemeral_arena.reset();
+      return env.Null();
+    }
+
+    if (this->skip_run()) {
+      this->_ephemeral_arena.reset();
+      if (!short_circuit) {
+        results.Set(i, this->new_result(env));
+      }
+      continue;
+    }
+
+    ddwaf_object result;
+    DDWAF_RET_CODE code = this->execute_run(&input, &result);
+    this->_ephemeral_arena.reset();
+
+    if (!short_circuit) {
+      results.Set(i, this->build_result(env, code, &result));
+    } else if (code == DDWAF_MATCH) {
+      Napi::Object match = this->build_result(env, code, &result);
+      match.Set("index", Napi::Number::New(env, i));
+      return match;
+    } else {
+      RunResultFields fields;
+      this->count_result(code, &result, &fields);
+      ddwaf_object_free(&result);
+    }
+  }
+
+  return short_circuit ? env.Null() : results;
+}
+
+void DDWAFContext::begin_body(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!this->check_runnable(env)) {
+    return;
+  }
+
+  if (this->_body.open) {
+    Napi::Error::New(env, "Calling beginBody before endBody").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (info.Length() < 2) {  // address, timeout
+    Napi::Error::New(env, "Wrong number of arguments, 2 expected").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (!info[0].IsString()) {
+    Napi::TypeError::New(env, "First argument must be a string").ThrowAsJavaScriptException();
+    return;
+  }
+
+  int64_t timeout = read_timeout(env, info[1]);
+  if (timeout == 0) {
+    return;
+  }
+
+  this->_body = StreamedBody();
+  this->_body.open = true;
+  this->_body.address = info[0].ToString().Utf8Value();
+  this->_body.timeout = timeout;
+  if (this->_options.address_limits) {
+    auto it = this->_options.address_limits->find(this->_body.address);
+    if (it != this->_options.address_limits->end()) {
+      this->_body.max_length = it->second.max_string_length;
+    }
+  }
+  // a body no rule looks at is never buffered
+  this->_body.done = this->_known_addresses && this->_known_addresses->count(this->_body.address) == 0;
+}
+
+// Returns the result of the run when the chunk completed the inspected part of the body, undefined otherwise
+Napi::Value DDWAFContext::push_chunk(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!this->check_runnable(env)) {
+    return env.Null();
+  }
+
+  if (!this->_body.open) {
+    Napi::Error::New(env, "Calling pushChunk before beginBody").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  const char* data = nullptr;
+  size_t length = 0;
+  bool is_string = info.Length() > 0 && info[0].IsString();
+  if (!is_string && (info.Length() == 0 || !info[0].IsObject() || !get_binary_data(env, info[0], &data, &length))) {
+    Napi::TypeError::New(env, "Chunk must be a string or a Buffer").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (this->_body.done) {
+    return env.Undefined();
+  }
+
+  size_t kept = this->_body.data.size();
+  size_t room = this->_body.max_length - kept;
+  if (is_string) {
+    // a UTF-16 code unit takes at most 3 bytes in UTF-8, the buffer only grows by what the chunk can fill
+    size_t units = 0;
+    napi_get_value_string_utf16(env, info[0], nullptr, 0, &units);
+    size_t capacity = std::min(room, units * 3);
+
+    // at most capacity bytes are transcoded, the encoder stops before a character that does not fit
+    this->_body.data.resize(kept + capacity);
+    size_t written = 0;
+    napi_get_value_string_utf8(env, info[0], &this->_body.data[kept], capacity + 1, &written);
+    this->_body.data.resize(kept + written);
+    if (capacity == room && written + 4 > room) {
+      napi_get_value_string_utf8(env, info[0], nullptr, 0, &length);
+    } else {
+      length = written;
+    }
+  } else {
+    this->_body.data.append(data, std::min(length, room));
+  }
+  this->_body.length += length;
+
+  if (this->_body.length < this->_body.max_length) {
+    return env.Undefined();
+  }
+  return this->run_body(env);
+}
+
+// Returns the result of the run, or undefined when the WAF already ran on the body
+Napi::Value DDWAFContext::end_body(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!this->check_runnable(env)) {
+    return env.Null();
+  }
+
+  if (!this->_body.open) {
+    Napi::Error::New(env, "Calling endBody before beginBody").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  Napi::Value result = this->_body.done ? env.Undefined() : this->run_body(env);
+  this->_body = StreamedBody();
+  return result;
+}
+
+// Sends the buffered body as a persistent address
+Napi::Value DDWAFContext::run_body(Napi::Env env) {
+  this->_body.done = true;
+
+  this->_metrics = {};
+  this->_metrics.converted_nodes = 1;
+  this->_metrics.converted_bytes = this->_body.data.size() + this->_body.address.size();
+  if (this->_body.length > this->_body.data.size()) {
+    // only the bytes received so far are known once the limit is reached
+    this->_metrics.max_truncated_string_length = this->_body.length;
+    this->_metrics.truncated_strings = 1;
+    this->_metrics.truncated_addresses.push_back(AddressTruncation{this->_body.address, this->_body.length, 0, 0});
+  }
+  if (this->_counters) {
+    this->_counters->add_conversion(this->_metrics);
+  }
+
+  DDWAFRunInput input;
+  ddwaf_object* entry = this->_persistent_arena.allocate_objects(1);
+  char* address = this->_persistent_arena.copy_string(this->_body.address.data(), this->_body.address.size());
+  char* body = this->_persistent_arena.copy_string(this->_body.data.data(), this->_body.data.size());
+  if (entry == nullptr || address == nullptr || body == nullptr) {
+    Napi::Error::New(env, "Could not allocate the body").ThrowAsJavaScriptException();
+    return env.Null();
   }
+  ddwaf_object_stringl_nc(entry, body, this->_body.data.size());
+  entry->parameterName = address;
+  entry->parameterNameLength = this->_body.address.size();
+  ddwaf_object_map(&input.persistent);
+  input.persistent.array = entry;
+  input.persistent.nbEntries = 1;
+  input.has_persistent = true;
+  input.timeout = static_cast<uint64_t>(this->_body.timeout);
+  // the body replaces the value last sent for its address
+  this->_persistent_memo.erase(this->_body.address);
+
+  this->_verdict_cacheable = false;
+  if (this->_verdict_cache) {
+    // the body is persistent data, the verdicts of the next runs depend on it like on the addresses of run()
+    this->_persistent_fingerprint = hash_object(&input.persistent, this->_persistent_fingerprint);
+  }
+
+  // the buffer is not needed anymore, later chunks are dropped
+  std::string().swap(this->_body.data);
 
   ddwaf_object result;
+  DDWAF_RET_CODE code = this->execute_run(&input, &result);
+  return this->build_result(env, code, &result);
+}
 
-  DDWAF_RET_CODE code = ddwaf_run(
-    this->_context,
-    ddwafPersistent,
-    ddwafEphemeral,
-    &result,
-    static_cast<uint64_t>(timeout));
+Napi::Value DDWAFContext::run_async(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
 
-  Napi::Object res = Napi::Object::New(env);
-  Napi::Object metrics = Napi::Object::New(env);
+  DDWAFRunInput input;
+  if (!this->prepare_run(info, &input)) {
+    return env.Null();
+  }
 
-  res.Set("metrics", metrics);
+  if (this->skip_run()) {
+    this->_ephemeral_arena.reset();
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    deferred.Resolve(this->new_result(env));
+    return deferred.Promise();
+  }
 
-  if (this->_metrics.max_truncated_string_length > 0) {
-    metrics.Set("maxTruncatedString",
-                Napi::Number::New(env, this->_metrics.max_truncated_string_length));
+  mlog("Queue async run");
+  this->_running = true;
+  DDWAFRunWorker* worker = new DDWAFRunWorker(env, this, info.This().As<Napi::Object>(), input);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+
+  return promise;
+}
+
+Napi::Object DDWAFContext::complete_run(Napi::Env env, DDWAF_RET_CODE code, ddwaf_object* result) {
+  this->_running = false;
+  this->_ephemeral_arena.reset();
+  if (this->_disposed) {
+    mlog("destroying context disposed during runAsync");
+    this->destroy();
   }
 
-  if (this->_metrics.max_truncated_container_size > 0) {
-    metrics.Set("maxTruncatedContainerSize",
-                Napi::Number::New(env, this->_metrics.max_truncated_container_size));
+  return this->build_result(env, code, result);
+}
+
+// Keeps a ddwaf_run result alive so that its events, actions and attributes are only converted to JS when first
+// read, see DDWAFOptions::lazy_results. Each field is an accessor whose getter function owns a reference to the
+// native result, so a getter taken out of its result object stays safe to call. The native result is freed once
+// every field has been read, or once every getter is collected.
+class LazyResult : public std::enable_shared_from_this<LazyResult> {
+ public:
+  enum Field { EVENTS, ACTIONS, ATTRIBUTES, FIELD_COUNT };
+
+  static std::shared_ptr<LazyResult> Create(const ddwaf_object& result) {
+    return std::shared_ptr<LazyResult>(new LazyResult(result));
   }
 
-  if (this->_metrics.max_truncated_container_depth > 0) {
-    metrics.Set("maxTruncatedContainerDepth",
-                Napi::Number::New(env, this->_metrics.max_truncated_container_depth));
+  ~LazyResult() {
+    this->release();
+  }
+
+  void Define(Napi::Env env, Napi::Object target, Field field, const ddwaf_object* object) {
+    this->_fields[field] = object;
+    this->_pending++;
+
+    Getter* getter = new Getter{this->shared_from_this(), field, Napi::Weak(target)};
+    Napi::Function get = Napi::Function::New(env, Get, NAMES[field], getter);
+    get.AddFinalizer([](Napi::Env, Getter* getter) {
+      delete getter;
+    }, getter);
+
+    Napi::Object descriptor = Napi::Object::New(env);
+    descriptor.Set("get", get);
+    descriptor.Set("enumerable", true);
+    descriptor.Set("configurable", true);
+    Napi::Function define_property = env.GetInstanceData<AddonData>()->define_property.Value();
+    define_property.Call({target, Napi::String::New(env, NAMES[field]), descriptor});
+  }
+
+ private:
+  static constexpr const char* NAMES[FIELD_COUNT] = {"events", "actions", "attributes"};
+
+  struct Getter {
+    std::shared_ptr<LazyResult> lazy;
+    Field field;
+    // result object the accessor was defined on, weak so that the getter does not keep it alive
+    Napi::ObjectReference target;
+  };
+
+  explicit LazyResult(const ddwaf_object& result) : _result(result), _fields{}, _pending(0), _released(false) {}
+
+  static Napi::Value Get(const Napi::CallbackInfo& info) {
+    Getter* getter = static_cast<Getter*>(info.Data());
+    Napi::Object target = getter->target.Value();
+    if (!target.IsEmpty() && (!info.This().StrictEquals(target) || getter->lazy->_fields[getter->field] == nullptr)) {
+      // called on another object, or already converted: read the field of the result the getter belongs to
+      return target.Get(NAMES[getter->field]);
+    }
+    return getter->lazy->Materialize(info.Env(), target, getter->field);
+  }
+
+  // target is empty once the result object was collected, the value is then only returned
+  Napi::Value Materialize(Napi::Env env, Napi::Object target, Field field) {
+    const ddwaf_object* object = this->_fields[field];
+    if (object == nullptr) {
+      return env.Undefined();
+    }
+
+    mlog("Materializing lazy result field");
+    Napi::Value value = from_ddwaf_object(object, env);
+
+    if (!target.IsEmpty()) {
+      // replace the getter by the converted value so that it is not converted again
+      napi_property_attributes attributes =
+        static_cast<napi_property_attributes>(napi_writable | napi_enumerable | napi_configurable);
+      target.DefineProperty(Napi::PropertyDescriptor::Value(NAMES[field], value, attributes));
+    }
+
+    this->_fields[field] = nullptr;
+    if (--this->_pending == 0) {
+      this->release();
+    }
+
+    return value;
+  }
+
+  void release() {
+    if (!this->_released) {
+      ddwaf_object_free(&this->_result);
+      this->_released = true;
+    }
+  }
+
+  ddwaf_object _result;
+  const ddwaf_object* _fields[FIELD_COUNT];
+  int _pending;
+  bool _released;
+};
+
+// Finds the fields of a ddwaf_run result and adds the run to the counters and to the verdict cache, returns false
+// when the run failed
+bool DDWAFContext::count_result(DDWAF_RET_CODE code, const ddwaf_object* result, RunResultFields* fields) {
+  bool cacheable = this->_verdict_cacheable;
+  this->_verdict_cacheable = false;
+
+  // the context may have been destroyed by a dispose() during runAsync
+  WAFCounters* counters = this->_counters ? this->_counters.get() : nullptr;
+  if (counters) {
+    counters->add(COUNTER_RUNS, 1);
   }
 
-  // Report if there is an error first
   switch (code) {
     case DDWAF_ERR_INTERNAL:
     case DDWAF_ERR_INVALID_OBJECT:
     case DDWAF_ERR_INVALID_ARGUMENT:
-      res.Set("errorCode", Napi::Number::New(env, code));
-      ddwaf_object_free(&result);
-      return res;
+      if (counters) {
+        counters->add(COUNTER_ERRORS, 1);
+      }
+      return false;
     default:
       break;
   }
 
-  // No error. Collect result data and return
-
-  const ddwaf_object *events = nullptr, *actions = nullptr, *attributes = nullptr,
-                     *keep = nullptr, *duration = nullptr, *run_timeout = nullptr;
-
-  for (size_t i = 0; i < ddwaf_object_size(&result); ++i) {
-    const ddwaf_object *child = ddwaf_object_get_index(&result, i);
+  for (size_t i = 0; i < ddwaf_object_size(result); ++i) {
+    const ddwaf_object *child = ddwaf_object_get_index(result, i);
     if (child == nullptr) {
       mlog("ddwaf result child is null")
       continue;
@@ -483,20 +2077,139 @@ Napi::Value DDWAFContext::run(const Napi::CallbackInfo& info) {
     }
 
     if (length == EVENTS_LEN && memcmp(key, "events", EVENTS_LEN) == 0) {
-      events = child;
+      fields->events = child;
     } else if (length == ACTIONS_LEN && memcmp(key, "actions", ACTIONS_LEN) == 0) {
-      actions = child;
+      fields->actions = child;
     } else if (length == ATTRIBUTES_LEN && memcmp(key, "attributes", ATTRIBUTES_LEN) == 0) {
-      attributes = child;
+      fields->attributes = child;
     } else if (length == KEEP_LEN && memcmp(key, "keep", KEEP_LEN) == 0) {
-      keep = child;
+      fields->keep = child;
     } else if (length == DURATION_LEN && memcmp(key, "duration", DURATION_LEN) == 0) {
-      duration = child;
+      fields->duration = child;
     } else if (length == TIMEOUT_LEN && memcmp(key, "timeout", TIMEOUT_LEN) == 0) {
-      run_timeout = child;
+      fields->timeout = child;
+    }
+  }
+
+  if (counters) {
+    if (fields->timeout && fields->timeout->type == DDWAF_OBJ_BOOL && fields->timeout->boolean) {
+      counters->add(COUNTER_TIMEOUTS, 1);
+    }
+    if (fields->duration && fields->duration->type == DDWAF_OBJ_UNSIGNED) {
+      counters->add(COUNTER_WAF_NS, fields->duration->uintValue);
+    }
+  }
+
+  if (this->_overload && fields->duration && fields->duration->type == DDWAF_OBJ_UNSIGNED) {
+    this->_overload->record(fields->duration->uintValue);
+  }
+
+  if (counters) {
+    if (code == DDWAF_MATCH) {
+      counters->add(COUNTER_MATCHES, 1);
     }
   }
 
+  if (code == DDWAF_MATCH) {
+    this->_matched = true;
+  } else if (cacheable && this->_verdict_cache && code == DDWAF_OK &&
+             !(fields->attributes && ddwaf_object_size(fields->attributes) > 0) &&
+             !(fields->timeout && fields->timeout->type == DDWAF_OBJ_BOOL && fields->timeout->boolean) &&
+             !(fields->keep && fields->keep->type == DDWAF_OBJ_BOOL && fields->keep->boolean)) {
+    // a cached verdict stands for an empty result, so only runs that produced nothing are cached
+    this->_verdict_cache->insert(this->_verdict_key, this->_persistent_fingerprint, std::move(this->_verdict_payload),
+                                 this->_generation);
+  }
+
+  return true;
+}
+
+// Result object holding the metrics of the conversion, which is all a skipped run returns
+Napi::Object DDWAFContext::new_result(Napi::Env env) {
+  Napi::Object res = Napi::Object::New(env);
+  Napi::Object metrics = Napi::Object::New(env);
+
+  res.Set("metrics", metrics);
+
+  if (this->_metrics.max_truncated_string_length > 0) {
+    metrics.Set("maxTruncatedString",
+                Napi::Number::New(env, this->_metrics.max_truncated_string_length));
+  }
+
+  if (this->_metrics.max_truncated_container_size > 0) {
+    metrics.Set("maxTruncatedContainerSize",
+                Napi::Number::New(env, this->_metrics.max_truncated_container_size));
+  }
+
+  if (this->_metrics.max_truncated_container_depth > 0) {
+    metrics.Set("maxTruncatedContainerDepth",
+                Napi::Number::New(env, this->_metrics.max_truncated_container_depth));
+  }
+
+  if (!this->_metrics.truncated_addresses.empty()) {
+    Napi::Object addresses = Napi::Object::New(env);
+    for (const AddressTruncation& truncation : this->_metrics.truncated_addresses) {
+      Napi::Object address = Napi::Object::New(env);
+      if (truncation.max_truncated_string_length > 0) {
+        address.Set("maxTruncatedString", Napi::Number::New(env, truncation.max_truncated_string_length));
+      }
+      if (truncation.max_truncated_container_size > 0) {
+        address.Set("maxTruncatedContainerSize", Napi::Number::New(env, truncation.max_truncated_container_size));
+      }
+      if (truncation.max_truncated_container_depth > 0) {
+        address.Set("maxTruncatedContainerDepth", Napi::Number::New(env, truncation.max_truncated_container_depth));
+      }
+      addresses.Set(truncation.address, address);
+    }
+    metrics.Set("truncatedAddresses", addresses);
+  }
+
+  if (this->_metrics.skipped_addresses > 0) {
+    metrics.Set("skippedAddresses", Napi::Number::New(env, this->_metrics.skipped_addresses));
+  }
+
+  if (this->_metrics.skipped_bytes > 0) {
+    metrics.Set("skippedBytes", Napi::Number::New(env, this->_metrics.skipped_bytes));
+  }
+
+  if (this->_metrics.conversion_duration > 0) {
+    res.Set("conversionDuration", Napi::Number::New(env, this->_metrics.conversion_duration));
+  }
+
+  if (this->_metrics.conversion_timeout) {
+    res.Set("conversionTimeout", Napi::Boolean::New(env, true));
+  }
+
+  if (this->_metrics.conversion_over_budget) {
+    res.Set("conversionOverBudget", Napi::Boolean::New(env, true));
+  }
+
+  if (this->_metrics.overload_skipped) {
+    metrics.Set("overload", Napi::String::New(env, "skipped"));
+  } else if (this->_metrics.overload_degraded) {
+    metrics.Set("overload", Napi::String::New(env, "degraded"));
+    metrics.Set("shedAddresses", Napi::Number::New(env, this->_metrics.shed_addresses));
+  }
+
+  return res;
+}
+
+Napi::Object DDWAFContext::build_result(Napi::Env env, DDWAF_RET_CODE code, ddwaf_object* result) {
+  Napi::Object res = this->new_result(env);
+
+  // Report if there is an error first
+  RunResultFields fields;
+  if (!this->count_result(code, result, &fields)) {
+    res.Set("errorCode", Napi::Number::New(env, code));
+    ddwaf_object_free(result);
+    return res;
+  }
+
+  // No error. Collect result data and return
+
+  const ddwaf_object *events = fields.events, *actions = fields.actions, *attributes = fields.attributes,
+                     *keep = fields.keep, *duration = fields.duration, *run_timeout = fields.timeout;
+
   mlog("Set timeout");
   if (run_timeout && run_timeout->type == DDWAF_OBJ_BOOL) {
     res.Set("timeout", Napi::Boolean::New(env, run_timeout->boolean));
@@ -507,23 +2220,46 @@ Napi::Value DDWAFContext::run(const Napi::CallbackInfo& info) {
     res.Set("duration", Napi::Number::New(env, duration->uintValue));
   }
 
-  if (attributes && ddwaf_object_size(attributes) > 0) {
+  bool match = code == DDWAF_MATCH;
+  if (attributes && ddwaf_object_size(attributes) == 0) {
+    attributes = nullptr;
+  }
+
+  std::shared_ptr<LazyResult> lazy;
+  if (this->_options.lazy_results && (attributes || (match && (events || actions)))) {
+    // from now on the result is owned by the lazy getters of res
+    lazy = LazyResult::Create(*result);
+  }
+
+  if (attributes) {
     mlog("Set attributes");
-    res.Set("attributes", from_ddwaf_object(attributes, env));
+    if (lazy) {
+      lazy->Define(env, res, LazyResult::ATTRIBUTES, attributes);
+    } else {
+      res.Set("attributes", from_ddwaf_object(attributes, env));
+    }
   }
 
-  if (code == DDWAF_MATCH) {
+  if (match) {
     mlog("ddwaf result is a match")
     res.Set("status", Napi::String::New(env, "match"));
 
     if (events) {
       mlog("Set events")
-      res.Set("events", from_ddwaf_object(events, env));
+      if (lazy) {
+        lazy->Define(env, res, LazyResult::EVENTS, events);
+      } else {
+        res.Set("events", from_ddwaf_object(events, env));
+      }
     }
 
     if (actions) {
       mlog("Set actions")
-      res.Set("actions", from_ddwaf_object(actions, env));
+      if (lazy) {
+        lazy->Define(env, res, LazyResult::ACTIONS, actions);
+      } else {
+        res.Set("actions", from_ddwaf_object(actions, env));
+      }
     }
   }
 
@@ -532,7 +2268,9 @@ Napi::Value DDWAFContext::run(const Napi::CallbackInfo& info) {
     res.Set("keep", Napi::Boolean::New(env, keep->boolean));
   }
 
-  ddwaf_object_free(&result);
+  if (!lazy) {
+    ddwaf_object_free(result);
+  }
 
   return res;
 }
@@ -545,18 +2283,26 @@ Napi::Object DDWAFContext::Init(Napi::Env env, Napi::Object exports) {
   mlog("Setting up class DDWAFContext");
   Napi::Function func = DefineClass(env, "DDWAFContext", {
     InstanceMethod<&DDWAFContext::run>("run"),
+    InstanceMethod<&DDWAFContext::run_async>("runAsync"),
+    InstanceMethod<&DDWAFContext::run_batch>("runBatch"),
+    InstanceMethod<&DDWAFContext::begin_body>("beginBody"),
+    InstanceMethod<&DDWAFContext::push_chunk>("pushChunk"),
+    InstanceMethod<&DDWAFContext::end_body>("endBody"),
     InstanceMethod<&DDWAFContext::dispose>("dispose"),
     InstanceAccessor("disposed", &DDWAFContext::GetDisposed, nullptr, napi_enumerable),
   });
 
-  Napi::FunctionReference* constructor = new Napi::FunctionReference();
-  *constructor = Napi::Persistent(func);
-  env.SetInstanceData(constructor);
+  env.GetInstanceData<AddonData>()->context_constructor = Napi::Persistent(func);
+
+  Napi::Object object = env.Global().Get("Object").As<Napi::Object>();
+  Napi::Function define_property = object.Get("defineProperty").As<Napi::Function>();
+  env.GetInstanceData<AddonData>()->define_property = Napi::Persistent(define_property);
   return exports;
 }
 
 // Initialize native add-on
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
+  env.SetInstanceData(new AddonData());
   DDWAF::Init(env, exports);
   DDWAFContext::Init(env, exports);
   return exports;
@@ -6,18 +6,126 @@
 #define SRC_MAIN_H_
 #include <napi.h>
 #include <ddwaf.h>
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
 #include "src/metrics.h"
+#include "src/arena.h"
+#include "src/convert.h"
+#include "src/counters.h"
+#include "src/overload.h"
+#include "src/shared_handle.h"
+#include "src/verdict_cache.h"
 
 #define LSTRARG(value) value, static_cast<uint32_t>(strlen(value))
 
 // TODO(@vdeturckheim): logs with ddwaf_set_log_cb
 // TODO(@vdeturckheim): fix issue when used with workers
 
+typedef std::unordered_set<std::string> AddressSet;
+typedef std::unordered_map<std::string, ConversionLimits> AddressLimits;
+// top-level persistent address -> weak reference to the RawJson wrapper last sent for it
+typedef std::unordered_map<std::string, Napi::ObjectReference> PersistentMemo;
+
+// Options of a DDWAF instance, inherited by the contexts it creates
+struct DDWAFOptions {
+  // do not send again a persistent address whose value is the RawJson wrapper with a string body last sent for it,
+  // other values can change in place and are always converted
+  bool memoize_persistent = false;
+  // events, actions and attributes of run() results are converted on first read
+  bool lazy_results = false;
+  // number of disposed contexts kept for reuse by createContext, 0 disables the pool
+  uint32_t context_pool_size = 0;
+  // number of no-match verdicts of ephemeral-only runs remembered to skip ddwaf_run, 0 disables the cache
+  uint32_t verdict_cache_size = 0;
+  // conversion limits of specific addresses, the others get the libddwaf defaults
+  std::shared_ptr<const AddressLimits> address_limits;
+  // caps of the nodes and bytes converted by a single run, 0 for none
+  size_t max_converted_nodes = 0;
+  size_t max_converted_bytes = 0;
+  // conversion and WAF time per second runs may use before being degraded then skipped, 0 disables the protection
+  uint64_t overload_budget_ns = 0;
+  // event loop lag past which runs are degraded, 0 to only look at the budget
+  uint64_t overload_lag_threshold_ns = 0;
+  // addresses still converted by degraded runs
+  std::shared_ptr<const AddressSet> degraded_addresses;
+};
+
+// Arenas of the disposed contexts of a DDWAF instance, waiting to be reused by createContext. Only the native state
+// is pooled: every context gets a new JS wrapper and a new ddwaf_context, so a reference kept to a disposed context
+// keeps throwing instead of running against the request the arenas were handed to.
+class ContextPool {
+ public:
+  explicit ContextPool(uint32_t capacity) : _capacity(capacity), _closed(false) {}
+
+  // Moves pooled arenas to the given ones, returns false when there is none to reuse
+  bool acquire(Arena* persistent, Arena* ephemeral) {
+    if (this->_entries.empty()) {
+      return false;
+    }
+    *persistent = std::move(this->_entries.back().persistent);
+    *ephemeral = std::move(this->_entries.back().ephemeral);
+    this->_entries.pop_back();
+    return true;
+  }
+
+  // Moves the reset arenas of a disposed context to the pool, returns false when they are left to their context
+  bool release(Arena* persistent, Arena* ephemeral) {
+    if (this->_closed || this->_entries.size() >= this->_capacity) {
+      return false;
+    }
+    this->_entries.push_back({std::move(*persistent), std::move(*ephemeral)});
+    return true;
+  }
+
+  void close() {
+    this->_closed = true;
+    this->_entries.clear();
+  }
+
+ private:
+  struct Entry {
+    Arena persistent;
+    Arena ephemeral;
+  };
+
+  uint32_t _capacity;
+  bool _closed;
+  std::vector<Entry> _entries;
+};
+
+class DDWAFConfigWorker;
+
+// Names known by a handle, copied while it is locked so that the JS sets can be built once it is released
+struct KnownNames {
+  std::vector<std::string> addresses;
+  std::vector<std::string> actions;
+  std::shared_ptr<const AddressSet> address_set;
+  uint64_t generation = 0;
+};
+
+// Per isolate data of the add-on
+struct AddonData {
+  Napi::FunctionReference waf_constructor;
+  Napi::FunctionReference context_constructor;
+  // Object.defineProperty, for the accessors of lazy results
+  Napi::FunctionReference define_property;
+};
+
 class DDWAF : public Napi::ObjectWrap<DDWAF> {
  public:
     // Static JS methods
     static Napi::Object Init(Napi::Env env, Napi::Object exports);
     static Napi::Value version(const Napi::CallbackInfo& info);
+    static Napi::Value attach(const Napi::CallbackInfo& info);
+    static Napi::Value raw_json(const Napi::CallbackInfo& info);
 
     // JS constructor
     explicit DDWAF(const Napi::CallbackInfo& info);
@@ -25,19 +133,88 @@ class DDWAF : public Napi::ObjectWrap<DDWAF> {
     // JS instance methods
     Napi::Value update_config(const Napi::CallbackInfo& info);
     Napi::Value remove_config(const Napi::CallbackInfo& info);
+    Napi::Value apply_configs(const Napi::CallbackInfo& info);
+    Napi::Value share(const Napi::CallbackInfo& info);
+    Napi::Value update_config_async(const Napi::CallbackInfo& info);
+    Napi::Value remove_config_async(const Napi::CallbackInfo& info);
     Napi::Value GetConfigPaths(const Napi::CallbackInfo& info);
+    Napi::Value GetOverload(const Napi::CallbackInfo& info);
+    Napi::Value GetDiagnostics(const Napi::CallbackInfo& info);
+    Napi::Value GetDiagnosticsSummary(const Napi::CallbackInfo& info);
+    Napi::Value get_config_diagnostics(const Napi::CallbackInfo& info);
     Napi::Value createContext(const Napi::CallbackInfo& info);
     void Finalize(Napi::Env env);
     Napi::Value GetDisposed(const Napi::CallbackInfo& info);
     void dispose(const Napi::CallbackInfo& info);
 
+    // Called by DDWAFConfigWorker on the JS thread once the builder is done
+    Napi::Value complete_config(Napi::Env env, DDWAFConfigWorker* worker);
+
  private:
-    void update_known_addresses(const Napi::CallbackInfo& info);
-    void update_known_actions(const Napi::CallbackInfo& info);
+    bool parse_options(Napi::Env env, Napi::Object config);
+    static bool read_limit(Napi::Env env, Napi::Object config, const char* name, uint32_t max, uint32_t* value);
+    void init_instance(Napi::Env env, std::shared_ptr<SharedHandle> shared);
+    void store_diagnostics(const std::string& path, ddwaf_object* diagnostics);
+    Napi::Value queue_config(DDWAFConfigWorker* worker);
+    void build_instance();
+    void refresh_known(Napi::Env env);
+    bool read_known(ddwaf_handle handle, uint64_t generation, KnownNames* known);
+    void publish_known(Napi::Env env, KnownNames* known);
+    void destroy();
 
     bool _disposed;
-    ddwaf_builder _builder;
-    ddwaf_handle _handle;
+    // builder and handle, possibly shared with instances of other threads
+    std::shared_ptr<SharedHandle> _shared;
+    // generation of the shared handle knownAddresses and knownActions were built from
+    uint64_t _generation = 0;
+    DDWAFOptions _options;
+    // native copy of knownAddresses, rebuilt whenever the handle changes
+    std::shared_ptr<const AddressSet> _known_address_set;
+    std::shared_ptr<WAFCounters> _counters;
+    std::shared_ptr<ContextPool> _context_pool;
+    std::shared_ptr<VerdictCache> _verdict_cache;
+    std::shared_ptr<OverloadGuard> _overload;
+    // native diagnostics of the last update of each config path, and of the last update overall which
+    // stays readable after its path is removed
+    std::unordered_map<std::string, std::shared_ptr<ddwaf_object>> _config_diagnostics;
+    std::shared_ptr<ddwaf_object> _last_diagnostics;
+    // conversion of _last_diagnostics, made on first read
+    Napi::Reference<Napi::Value> _diagnostics_js;
+    // async config updates, the one at the front is running
+    std::deque<DDWAFConfigWorker*> _config_queue;
+};
+
+// Fields of a ddwaf_run result, null when absent
+struct RunResultFields {
+  const ddwaf_object* events = nullptr;
+  const ddwaf_object* actions = nullptr;
+  const ddwaf_object* attributes = nullptr;
+  const ddwaf_object* keep = nullptr;
+  const ddwaf_object* duration = nullptr;
+  const ddwaf_object* timeout = nullptr;
+};
+
+// Request body streamed with beginBody(), pushChunk() and endBody(). Only the first DDWAF_MAX_STRING_LENGTH bytes
+// are kept, the WAF runs once on them as soon as they are all there or when the body ends.
+struct StreamedBody {
+  bool open = false;
+  // the WAF already ran on the body, or its address is not used by the ruleset: chunks are dropped
+  bool done = false;
+  std::string address;
+  std::string data;
+  // bytes received, including the dropped ones
+  size_t length = 0;
+  // bytes buffered at most, the string length limit of the address
+  size_t max_length = DDWAF_MAX_STRING_LENGTH;
+  int64_t timeout = 0;
+};
+
+struct DDWAFRunInput {
+  ddwaf_object persistent;
+  ddwaf_object ephemeral;
+  bool has_persistent = false;
+  bool has_ephemeral = false;
+  uint64_t timeout = 0;
 };
 
 class DDWAFContext : public Napi::ObjectWrap<DDWAFContext> {
@@ -50,16 +227,73 @@ class DDWAFContext : public Napi::ObjectWrap<DDWAFContext> {
 
     // JS instance methods
     Napi::Value run(const Napi::CallbackInfo& info);
+    Napi::Value run_async(const Napi::CallbackInfo& info);
+    Napi::Value run_batch(const Napi::CallbackInfo& info);
+    void begin_body(const Napi::CallbackInfo& info);
+    Napi::Value push_chunk(const Napi::CallbackInfo& info);
+    Napi::Value end_body(const Napi::CallbackInfo& info);
     Napi::Value GetDisposed(const Napi::CallbackInfo& info);
     void dispose(const Napi::CallbackInfo& info);
     void Finalize(Napi::Env env);
 
-    // C++ only instance method
-    bool init(ddwaf_handle handle);
+    // C++ only instance methods
+    bool init(
+      ddwaf_handle handle,
+      const DDWAFOptions& options,
+      std::shared_ptr<const AddressSet> known_addresses,
+      std::shared_ptr<WAFCounters> counters,
+      std::weak_ptr<ContextPool> pool,
+      std::shared_ptr<VerdictCache> verdict_cache,
+      std::shared_ptr<OverloadGuard> overload,
+      uint64_t generation
+    );
+    DDWAF_RET_CODE execute_run(DDWAFRunInput* input, ddwaf_object* result);
+    Napi::Object complete_run(Napi::Env env, DDWAF_RET_CODE code, ddwaf_object* result);
 
  private:
+    bool check_runnable(Napi::Env env);
+    bool prepare_run(const Napi::CallbackInfo& info, DDWAFRunInput* input);
+    bool convert_run_payload(
+      Napi::Env env,
+      Napi::Value persistent,
+      Napi::Value ephemeral,
+      std::chrono::steady_clock::time_point deadline,
+      DDWAFRunInput* input
+    );
+    void destroy();
+    Napi::Value run_body(Napi::Env env);
+    bool skip_run();
+    Napi::Object new_result(Napi::Env env);
+    bool count_result(DDWAF_RET_CODE code, const ddwaf_object* result, RunResultFields* fields);
+    Napi::Object build_result(Napi::Env env, DDWAF_RET_CODE code, ddwaf_object* result);
+
     bool _disposed;
-    ddwaf_context _context;
+    // true while a runAsync job owns the ddwaf_context on the threadpool
+    bool _running;
+    ddwaf_context _context = nullptr;
     WAFTruncationMetrics _metrics;
+    // persistent data must outlive the ddwaf_context, ephemeral data only a single ddwaf_run
+    Arena _persistent_arena;
+    Arena _ephemeral_arena;
+    DDWAFOptions _options;
+    // addresses consumed by the ruleset of the handle the context was created from
+    std::shared_ptr<const AddressSet> _known_addresses;
+    std::shared_ptr<WAFCounters> _counters;
+    // pool the arenas return to on dispose(), and handle generation the context was created from
+    std::weak_ptr<ContextPool> _pool;
+    uint64_t _generation = 0;
+    StreamedBody _body;
+    std::shared_ptr<VerdictCache> _verdict_cache;
+    // keyed hash chain of the persistent data sent so far, part of the verdict cache entries
+    uint64_t _persistent_fingerprint = 0;
+    // verdicts are only cached until the first match, after which rules may not fire again in the context
+    bool _matched = false;
+    // key and serialized ephemeral payload of the run being evaluated, set when its verdict can be cached
+    bool _verdict_cacheable = false;
+    uint64_t _verdict_key = 0;
+    std::string _verdict_payload;
+    std::shared_ptr<OverloadGuard> _overload;
+    // see DDWAFOptions::memoize_persistent
+    PersistentMemo _persistent_memo;
 };
 #endif  // SRC_MAIN_H_
@@ -8,10 +8,84 @@
 
 #include <napi.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Truncations of the value of a single address
+struct AddressTruncation {
+  std::string address;
+  size_t max_truncated_string_length;
+  size_t max_truncated_container_size;
+  size_t max_truncated_container_depth;
+};
+
 struct WAFTruncationMetrics {
   size_t max_truncated_string_length = 0;
   size_t max_truncated_container_size = 0;
   size_t max_truncated_container_depth = 0;
+  // top-level addresses left out because no rule consumes them
+  size_t skipped_addresses = 0;
+  size_t skipped_bytes = 0;
+  // totals accumulated into the instance counters, not reported in run results
+  size_t converted_nodes = 0;
+  size_t converted_bytes = 0;
+  size_t truncated_strings = 0;
+  size_t truncated_containers = 0;
+  size_t truncated_depths = 0;
+  // time spent converting the payload in ns, and whether it was cut short by the run timeout
+  uint64_t conversion_duration = 0;
+  bool conversion_timeout = false;
+  // whether the conversion stopped at the node or byte cap of the run
+  bool conversion_over_budget = false;
+  // overload protection: the run only converted the degraded addresses, or was skipped altogether
+  bool overload_degraded = false;
+  bool overload_skipped = false;
+  // addresses left out by a degraded run
+  size_t shed_addresses = 0;
+  // addresses that had something truncated, in payload order
+  std::vector<AddressTruncation> truncated_addresses;
+};
+
+// Measures the truncations of the value of one address on their own, the maxima of the run keep including them
+class AddressTruncationScope {
+ public:
+  explicit AddressTruncationScope(WAFTruncationMetrics* metrics)
+    : _metrics(metrics), _string_length(0), _container_size(0), _container_depth(0) {
+    if (metrics == nullptr) {
+      return;
+    }
+    std::swap(this->_string_length, metrics->max_truncated_string_length);
+    std::swap(this->_container_size, metrics->max_truncated_container_size);
+    std::swap(this->_container_depth, metrics->max_truncated_container_depth);
+  }
+
+  void end(const char* address, size_t length) {
+    WAFTruncationMetrics* metrics = this->_metrics;
+    if (metrics == nullptr) {
+      return;
+    }
+    if (metrics->max_truncated_string_length > 0 || metrics->max_truncated_container_size > 0 ||
+        metrics->max_truncated_container_depth > 0) {
+      metrics->truncated_addresses.push_back(AddressTruncation{
+        std::string(address, length),
+        metrics->max_truncated_string_length,
+        metrics->max_truncated_container_size,
+        metrics->max_truncated_container_depth
+      });
+    }
+    metrics->max_truncated_string_length = std::max(metrics->max_truncated_string_length, this->_string_length);
+    metrics->max_truncated_container_size = std::max(metrics->max_truncated_container_size, this->_container_size);
+    metrics->max_truncated_container_depth = std::max(metrics->max_truncated_container_depth,
+                                                      this->_container_depth);
+  }
+
+ private:
+  WAFTruncationMetrics* _metrics;
+  size_t _string_length;
+  size_t _container_size;
+  size_t _container_depth;
 };
 
 #endif  // SRC_METRICS_H_
@@ -0,0 +1,61 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+
+#ifndef SRC_OBJECT_STACK_H_
+#define SRC_OBJECT_STACK_H_
+
+#include <node_api.h>
+#include <ddwaf.h>
+
+#include <cstddef>
+#include <vector>
+
+// Native stack of the containers currently being converted, used for cycle detection.
+// Node-API does not expose a stable identity hash for JS objects, so lookups compare handles with
+// napi_strict_equals. The conversion limits bound its depth, which keeps the stack small enough for a linear scan
+// and means no JS function is ever called for this bookkeeping. The containers past DDWAF_MAX_CONTAINER_DEPTH, only
+// reached by addresses given a larger maxContainerDepth, are kept on the heap.
+class ObjectStack {
+ public:
+  explicit ObjectStack(napi_env env) : _env(env), _size(0) {}
+
+  bool Has(napi_value value) const {
+    for (size_t i = 0; i < _size; ++i) {
+      bool equals = false;
+      napi_value entry = i < INLINE_CAPACITY ? _values[i] : _overflow[i - INLINE_CAPACITY];
+      if (napi_strict_equals(_env, entry, value, &equals) == napi_ok && equals) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Push(napi_value value) {
+    if (_size < INLINE_CAPACITY) {
+      _values[_size] = value;
+    } else {
+      _overflow.push_back(value);
+    }
+    ++_size;
+  }
+
+  void Pop() {
+    if (_size > INLINE_CAPACITY) {
+      _overflow.pop_back();
+    }
+    if (_size > 0) {
+      --_size;
+    }
+  }
+
+ private:
+  static constexpr size_t INLINE_CAPACITY = DDWAF_MAX_CONTAINER_DEPTH;
+
+  napi_env _env;
+  size_t _size;
+  napi_value _values[INLINE_CAPACITY];
+  std::vector<napi_value> _overflow;
+};
+#endif  // SRC_OBJECT_STACK_H_
@@ -0,0 +1,101 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+
+#ifndef SRC_OVERLOAD_H_
+#define SRC_OVERLOAD_H_
+
+#include <uv.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+enum OverloadDecision {
+  OVERLOAD_NONE,
+  // only the addresses of DDWAFOptions::degraded_addresses are converted
+  OVERLOAD_DEGRADED,
+  // the run does not convert anything nor call ddwaf_run
+  OVERLOAD_SKIPPED
+};
+
+// Token bucket over the time spent converting payloads and in ddwaf_run, see the overload option. The bucket holds
+// up to one second of budget and refills continuously. Runs are degraded once it is down to a quarter, or when the
+// event loop lags behind, and skipped once it is empty. Only used from the JS thread.
+class OverloadGuard {
+ public:
+  OverloadGuard(uint64_t budget_ns, uint64_t lag_threshold_ns, uv_loop_t* loop)
+    : _budget_ns(budget_ns), _lag_threshold_ns(lag_threshold_ns), _loop(loop),
+      _tokens(static_cast<int64_t>(budget_ns)), _last_refill(std::chrono::steady_clock::now()),
+      _average_cost_ns(0), _average_lag_ns(0) {}
+
+  OverloadDecision decide() {
+    auto now = std::chrono::steady_clock::now();
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->_last_refill).count();
+    this->_last_refill = now;
+    // elapsed is capped so that the multiplication cannot overflow, a second refills the whole bucket anyway
+    int64_t refill = static_cast<int64_t>(
+      static_cast<double>(this->_budget_ns) * static_cast<double>(std::min<int64_t>(elapsed, NS_PER_S)) / NS_PER_S);
+    this->_tokens = std::min(this->_tokens + refill, static_cast<int64_t>(this->_budget_ns));
+
+    this->_average_lag_ns = average(this->_average_lag_ns, this->loop_lag());
+
+    if (this->_tokens <= 0) {
+      return OVERLOAD_SKIPPED;
+    }
+    if (this->_tokens < static_cast<int64_t>(this->_budget_ns / 4) ||
+        (this->_lag_threshold_ns > 0 && this->_average_lag_ns > this->_lag_threshold_ns)) {
+      return OVERLOAD_DEGRADED;
+    }
+    return OVERLOAD_NONE;
+  }
+
+  // Takes the conversion and WAF time of a run out of the bucket
+  void record(uint64_t cost_ns) {
+    this->_tokens -= static_cast<int64_t>(std::min<uint64_t>(cost_ns, this->_budget_ns));
+    this->_average_cost_ns = average(this->_average_cost_ns, cost_ns);
+  }
+
+  // may be negative after an expensive run
+  int64_t tokens() const {
+    return this->_tokens;
+  }
+
+  uint64_t average_cost() const {
+    return this->_average_cost_ns;
+  }
+
+  uint64_t average_lag() const {
+    return this->_average_lag_ns;
+  }
+
+ private:
+  static constexpr int64_t NS_PER_S = 1000000000;
+
+  // Time since the event loop last updated its clock, which it does once per iteration before running callbacks:
+  // how long the current iteration has been blocking the loop. The loop clock only has a millisecond resolution.
+  uint64_t loop_lag() const {
+    if (this->_loop == nullptr) {
+      return 0;
+    }
+    uint64_t now_ns = uv_hrtime();
+    uint64_t loop_ns = uv_now(this->_loop) * 1000000;
+    return now_ns > loop_ns ? now_ns - loop_ns : 0;
+  }
+
+  // exponential moving average over roughly the last 8 samples
+  static uint64_t average(uint64_t average, uint64_t sample) {
+    return average - average / 8 + sample / 8;
+  }
+
+  uint64_t _budget_ns;
+  uint64_t _lag_threshold_ns;
+  uv_loop_t* _loop;
+  int64_t _tokens;
+  std::chrono::steady_clock::time_point _last_refill;
+  uint64_t _average_cost_ns;
+  uint64_t _average_lag_ns;
+};
+
+#endif  // SRC_OVERLOAD_H_
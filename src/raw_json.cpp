@@ -0,0 +1,605 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+// min support Node.js 18.0.0 - https://nodejs.org/api/n-api.html#node-api-version-matrix
+#define NAPI_VERSION  8
+#include <napi.h>
+#include <ddwaf.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/raw_json.h"
+#include "src/log.h"
+
+// identifies the objects returned by DDWAF.rawJson()
+static const napi_type_tag RAW_JSON_TAG = { 0x6464776166726177ULL, 0x6a736f6e626f6479ULL };
+
+namespace {
+
+// Builds the ddwaf_object tree of a JSON document. Containers are built at most max_container_depth levels deep,
+// deeper values and the entries past max_container_size are validated without being built.
+class JsonParser {
+ public:
+  JsonParser(const char* data, size_t length, const ConversionLimits& limits, Arena* arena,
+             WAFTruncationMetrics* metrics, ConversionBudget* budget)
+    : _data(data), _end(data + length), _limits(limits), _arena(arena), _metrics(metrics), _budget(budget),
+      _stopped(false) {}
+
+  bool parse(ddwaf_object* object, int depth) {
+    if (!this->value(object, depth)) {
+      return false;
+    }
+    if (this->_stopped) {
+      return true;
+    }
+    this->skip_whitespace();
+    return this->_data == this->_end;
+  }
+
+ private:
+  void skip_whitespace() {
+    while (this->_data < this->_end &&
+           (*this->_data == ' ' || *this->_data == '\n' || *this->_data == '\r' || *this->_data == '\t')) {
+      ++this->_data;
+    }
+  }
+
+  bool value(ddwaf_object* object, int depth) {
+    if (this->_metrics) {
+      this->_metrics->converted_nodes++;
+    }
+    if (depth >= static_cast<int>(this->_limits.max_container_depth)) {
+      mlog("Max depth reached");
+      if (this->_metrics) {
+        this->_metrics->max_truncated_container_depth = std::max(this->_metrics->max_truncated_container_depth,
+                                                                 static_cast<size_t>(depth));
+        this->_metrics->truncated_depths++;
+      }
+      ddwaf_object_map(object);
+      return this->skip();
+    }
+
+    this->skip_whitespace();
+    if (this->_data == this->_end) {
+      return false;
+    }
+
+    switch (*this->_data) {
+      case '{':
+      case '[':
+        return this->container(object, depth + 1);
+      case '"': {
+        size_t length = 0;
+        const char* str = this->string(this->_limits.max_string_length, &length);
+        if (str == nullptr) {
+          return false;
+        }
+        ddwaf_object_stringl_nc(object, str, length);
+        return true;
+      }
+      case 't':
+        ddwaf_object_bool(object, true);
+        return this->literal("true", 4);
+      case 'f':
+        ddwaf_object_bool(object, false);
+        return this->literal("false", 5);
+      case 'n':
+        ddwaf_object_null(object);
+        return this->literal("null", 4);
+      default:
+        return this->number(object);
+    }
+  }
+
+  bool literal(const char* expected, size_t length) {
+    if (static_cast<size_t>(this->_end - this->_data) < length || memcmp(this->_data, expected, length) != 0) {
+      return false;
+    }
+    this->_data += length;
+    return true;
+  }
+
+  // Numbers are floats, like the ones of a JSON.parse() result
+  bool number(ddwaf_object* object) {
+    const char* start = this->_data;
+    if (!this->skip_number()) {
+      return false;
+    }
+    size_t length = static_cast<size_t>(this->_data - start);
+    char buffer[64];
+    if (length < sizeof(buffer)) {
+      memcpy(buffer, start, length);
+      buffer[length] = '\0';
+      ddwaf_object_float(object, strtod(buffer, nullptr));
+    } else {
+      ddwaf_object_float(object, strtod(std::string(start, length).c_str(), nullptr));
+    }
+    return true;
+  }
+
+  bool skip_number() {
+    const char* p = this->_data;
+    auto digits = [&]() {
+      const char* first = p;
+      while (p < this->_end && *p >= '0' && *p <= '9') {
+        ++p;
+      }
+      return p > first;
+    };
+
+    if (p < this->_end && *p == '-') {
+      ++p;
+    }
+    const char* integer = p;
+    if (!digits() || (*integer == '0' && p - integer > 1)) {
+      return false;
+    }
+    if (p < this->_end && *p == '.') {
+      ++p;
+      if (!digits()) {
+        return false;
+      }
+    }
+    if (p < this->_end && (*p == 'e' || *p == 'E')) {
+      ++p;
+      if (p < this->_end && (*p == '+' || *p == '-')) {
+        ++p;
+      }
+      if (!digits()) {
+        return false;
+      }
+    }
+    this->_data = p;
+    return true;
+  }
+
+  // Decodes the string at the cursor into the arena, keeping at most max_length bytes
+  const char* string(size_t max_length, size_t* length) {
+    ++this->_data;  // opening quote
+
+    // the decoded string is never longer than its JSON form
+    const char* closing = this->_data;
+    while (closing < this->_end && *closing != '"') {
+      closing += *closing == '\\' ? 2 : 1;
+    }
+    if (closing >= this->_end) {
+      return nullptr;
+    }
+
+    size_t capacity = std::min(static_cast<size_t>(closing - this->_data), max_length);
+    char* buffer = static_cast<char*>(this->_arena->allocate(capacity + 1, 1));
+    if (buffer == nullptr) {
+      return nullptr;
+    }
+
+    size_t written = 0;
+    size_t full_length = 0;
+    while (this->_data < closing) {
+      char utf8[4];
+      size_t size = 1;
+      if (*this->_data != '\\') {
+        if (static_cast<unsigned char>(*this->_data) < 0x20) {
+          return nullptr;
+        }
+        utf8[0] = *this->_data++;
+      } else if (!this->escape(utf8, &size)) {
+        return nullptr;
+      }
+
+      // nothing is written after the first character that does not fit
+      if (full_length == written && written + size <= capacity) {
+        memcpy(buffer + written, utf8, size);
+        written += size;
+      }
+      full_length += size;
+    }
+    ++this->_data;  // closing quote
+
+    if (full_length > written) {
+      // raw bytes of a multibyte character are copied one by one, drop the ones of a character cut in the middle
+      written = complete_utf8_length(buffer, written);
+    }
+    buffer[written] = '\0';
+    this->_arena->shrink_last(buffer, written + 1);
+
+    if (this->_metrics) {
+      this->_metrics->converted_bytes += written;
+      if (full_length > written) {
+        this->_metrics->max_truncated_string_length = std::max(this->_metrics->max_truncated_string_length,
+                                                               full_length);
+        this->_metrics->truncated_strings++;
+      }
+    }
+    *length = written;
+    return buffer;
+  }
+
+  static size_t complete_utf8_length(const char* str, size_t length) {
+    size_t start = length;
+    while (start > 0 && (static_cast<unsigned char>(str[start - 1]) & 0xC0) == 0x80) {
+      --start;
+    }
+    if (start == 0) {
+      return length;
+    }
+    unsigned char lead = static_cast<unsigned char>(str[start - 1]);
+    size_t expected = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    return length - (start - 1) >= expected ? length : start - 1;
+  }
+
+  // Decodes the escape sequence at the cursor as UTF-8
+  bool escape(char* utf8, size_t* size) {
+    ++this->_data;  // backslash
+    if (this->_data >= this->_end) {
+      return false;
+    }
+    *size = 1;
+    switch (*this->_data++) {
+      case '"': utf8[0] = '"'; return true;
+      case '\\': utf8[0] = '\\'; return true;
+      case '/': utf8[0] = '/'; return true;
+      case 'b': utf8[0] = '\b'; return true;
+      case 'f': utf8[0] = '\f'; return true;
+      case 'n': utf8[0] = '\n'; return true;
+      case 'r': utf8[0] = '\r'; return true;
+      case 't': utf8[0] = '\t'; return true;
+      case 'u': break;
+      default: return false;
+    }
+
+    uint32_t code_point = 0;
+    if (!this->hex4(&code_point)) {
+      return false;
+    }
+    if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+      uint32_t low = 0;
+      const char* checkpoint = this->_data;
+      if (this->literal("\\u", 2) && this->hex4(&low) && low >= 0xDC00 && low <= 0xDFFF) {
+        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+      } else {
+        this->_data = checkpoint;
+        code_point = 0xFFFD;
+      }
+    } else if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+      // lone surrogates are replaced like when V8 encodes a JS string to UTF-8
+      code_point = 0xFFFD;
+    }
+
+    if (code_point < 0x80) {
+      utf8[0] = static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+      utf8[0] = static_cast<char>(0xC0 | (code_point >> 6));
+      utf8[1] = static_cast<char>(0x80 | (code_point & 0x3F));
+      *size = 2;
+    } else if (code_point < 0x10000) {
+      utf8[0] = static_cast<char>(0xE0 | (code_point >> 12));
+      utf8[1] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+      utf8[2] = static_cast<char>(0x80 | (code_point & 0x3F));
+      *size = 3;
+    } else {
+      utf8[0] = static_cast<char>(0xF0 | (code_point >> 18));
+      utf8[1] = static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+      utf8[2] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+      utf8[3] = static_cast<char>(0x80 | (code_point & 0x3F));
+      *size = 4;
+    }
+    return true;
+  }
+
+  bool hex4(uint32_t* value) {
+    if (this->_end - this->_data < 4) {
+      return false;
+    }
+    for (int i = 0; i < 4; ++i) {
+      char c = *this->_data++;
+      uint32_t digit;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        digit = c - 'A' + 10;
+      } else {
+        return false;
+      }
+      *value = (*value << 4) | digit;
+    }
+    return true;
+  }
+
+  // Entries are parsed at depth. They are gathered in a scratch vector per depth, reused from one container to the
+  // next, and copied into the arena once their number is known.
+  bool container(ddwaf_object* object, int depth) {
+    bool keyed = *this->_data++ == '{';
+    char closing = keyed ? '}' : ']';
+    if (this->_scratch.size() <= static_cast<size_t>(depth)) {
+      this->_scratch.resize(depth + 1);
+    }
+    std::vector<ddwaf_object>& entries = this->_scratch[depth];
+    entries.clear();
+
+    size_t count = 0;
+    this->skip_whitespace();
+    if (this->_data < this->_end && *this->_data == closing) {
+      ++this->_data;
+    } else {
+      for (;;) {
+        if (this->_budget != nullptr && this->_budget->exhausted()) {
+          mlog("Conversion budget exhausted");
+          this->_stopped = true;
+          break;
+        }
+
+        const char* key = nullptr;
+        size_t key_length = 0;
+        if (keyed) {
+          this->skip_whitespace();
+          if (this->_data == this->_end || *this->_data != '"') {
+            return false;
+          }
+          if (count < this->_limits.max_container_size) {
+            key = this->string(SIZE_MAX, &key_length);
+            if (key == nullptr) {
+              return false;
+            }
+          } else if (!this->skip_string()) {
+            return false;
+          }
+          this->skip_whitespace();
+          if (this->_data == this->_end || *this->_data++ != ':') {
+            return false;
+          }
+        }
+
+        if (count < this->_limits.max_container_size) {
+          ddwaf_object entry;
+          if (!this->value(&entry, depth)) {
+            return false;
+          }
+          if (keyed) {
+            entry.parameterName = key;
+            entry.parameterNameLength = key_length;
+          }
+          // a nested container may have used the scratch vectors of the deeper levels, never this one
+          entries.push_back(entry);
+        } else if (!this->skip()) {
+          return false;
+        }
+        ++count;
+
+        if (this->_stopped) {
+          break;
+        }
+        this->skip_whitespace();
+        if (this->_data == this->_end) {
+          return false;
+        }
+        char separator = *this->_data++;
+        if (separator == closing) {
+          break;
+        }
+        if (separator != ',') {
+          return false;
+        }
+      }
+    }
+
+    if (count > this->_limits.max_container_size && this->_metrics) {
+      this->_metrics->max_truncated_container_size = std::max(this->_metrics->max_truncated_container_size, count);
+      this->_metrics->truncated_containers++;
+    }
+
+    if (keyed) {
+      ddwaf_object_map(object);
+    } else {
+      ddwaf_object_array(object);
+    }
+    if (entries.empty()) {
+      return true;
+    }
+    ddwaf_object* array = this->_arena->allocate_objects(entries.size());
+    if (array == nullptr) {
+      mlog("failed to allocate container entries");
+      return true;
+    }
+    memcpy(array, entries.data(), entries.size() * sizeof(ddwaf_object));
+    object->array = array;
+    object->nbEntries = entries.size();
+    return true;
+  }
+
+  // Moves past one value without building it, with the same checks as when it is built. The closing character of
+  // each open container is kept in a string rather than on the native stack, so arbitrarily deep documents cannot
+  // overflow it.
+  bool skip() {
+    std::string open;
+    for (;;) {
+      this->skip_whitespace();
+      if (this->_data == this->_end) {
+        return false;
+      }
+
+      char first = *this->_data;
+      if (first == '{' || first == '[') {
+        char closing = first == '{' ? '}' : ']';
+        ++this->_data;
+        this->skip_whitespace();
+        if (this->_data < this->_end && *this->_data == closing) {
+          ++this->_data;
+        } else {
+          open.push_back(closing);
+          if (closing == '}' && !this->skip_key()) {
+            return false;
+          }
+          continue;
+        }
+      } else if (!this->skip_scalar()) {
+        return false;
+      }
+
+      // a value was skipped, close the containers it ends until one has another entry
+      for (;;) {
+        if (open.empty()) {
+          return true;
+        }
+        this->skip_whitespace();
+        if (this->_data == this->_end) {
+          return false;
+        }
+        char separator = *this->_data++;
+        if (separator == open.back()) {
+          open.pop_back();
+          continue;
+        }
+        if (separator != ',' || (open.back() == '}' && !this->skip_key())) {
+          return false;
+        }
+        break;
+      }
+    }
+  }
+
+  // Moves past an object key and the colon following it
+  bool skip_key() {
+    this->skip_whitespace();
+    if (this->_data == this->_end || *this->_data != '"' || !this->skip_string()) {
+      return false;
+    }
+    this->skip_whitespace();
+    return this->_data < this->_end && *this->_data++ == ':';
+  }
+
+  bool skip_scalar() {
+    switch (*this->_data) {
+      case '"':
+        return this->skip_string();
+      case 't':
+        return this->literal("true", 4);
+      case 'f':
+        return this->literal("false", 5);
+      case 'n':
+        return this->literal("null", 4);
+      default:
+        return this->skip_number();
+    }
+  }
+
+  // Moves past the string at the cursor, rejecting the control characters and escapes string() rejects
+  bool skip_string() {
+    ++this->_data;  // opening quote
+    while (this->_data < this->_end && *this->_data != '"') {
+      if (*this->_data == '\\') {
+        char utf8[4];
+        size_t size = 0;
+        if (!this->escape(utf8, &size)) {
+          return false;
+        }
+      } else if (static_cast<unsigned char>(*this->_data++) < 0x20) {
+        return false;
+      }
+    }
+    if (this->_data >= this->_end) {
+      return false;
+    }
+    ++this->_data;  // closing quote
+    return true;
+  }
+
+  const char* _data;
+  const char* _end;
+  const ConversionLimits& _limits;
+  Arena* _arena;
+  WAFTruncationMetrics* _metrics;
+  ConversionBudget* _budget;
+  bool _stopped;
+  // one per depth, only up to the deepest container met: a deque keeps the references to them valid as it grows
+  std::deque<std::vector<ddwaf_object>> _scratch;
+};
+
+}  // namespace
+
+Napi::Value make_raw_json(Napi::Env env, Napi::Value body) {
+  const char* data = nullptr;
+  size_t length = 0;
+  if (!body.IsString() && !(body.IsObject() && get_binary_data(env, body, &data, &length))) {
+    return Napi::Value();
+  }
+
+  Napi::Object raw_json = Napi::Object::New(env);
+  raw_json.Set("body", body);
+  napi_type_tag_object(env, raw_json, &RAW_JSON_TAG);
+  napi_object_freeze(env, raw_json);
+  return raw_json;
+}
+
+bool get_raw_json(napi_env env, napi_value value, napi_value* body) {
+  napi_valuetype type;
+  bool tagged = false;
+  if (napi_typeof(env, value, &type) != napi_ok || type != napi_object ||
+      napi_check_object_type_tag(env, value, &RAW_JSON_TAG, &tagged) != napi_ok || !tagged) {
+    return false;
+  }
+  return napi_get_named_property(env, value, "body", body) == napi_ok;
+}
+
+ddwaf_object* to_ddwaf_raw_json(
+  ddwaf_object *object,
+  napi_env env,
+  napi_value body,
+  int depth,
+  const ConversionLimits &limits,
+  Arena *arena,
+  WAFTruncationMetrics *metrics,
+  ConversionBudget *budget
+) {
+  const char* data = nullptr;
+  size_t length = 0;
+  std::string text;
+  if (!get_binary_data(env, body, &data, &length)) {
+    size_t utf8_length = 0;
+    if (napi_get_value_string_utf8(env, body, nullptr, 0, &utf8_length) != napi_ok) {
+      return ddwaf_object_invalid(object);
+    }
+    text.resize(utf8_length);
+    napi_get_value_string_utf8(env, body, &text[0], utf8_length + 1, &length);
+    data = text.data();
+  }
+
+  // metrics are updated as the document is parsed so that the budget sees them, and rolled back if it is not JSON
+  WAFTruncationMetrics previous_metrics;
+  if (metrics) {
+    previous_metrics = *metrics;
+  }
+  JsonParser parser(data, length, limits, arena, metrics, budget);
+  if (parser.parse(object, depth)) {
+    return object;
+  }
+  if (metrics) {
+    *metrics = std::move(previous_metrics);
+  }
+
+  // not JSON, the WAF gets the body as it is
+  mlog("Invalid JSON body");
+  size_t copied = std::min(length, static_cast<size_t>(limits.max_string_length));
+  char* str = arena->copy_string(data, copied);
+  if (str == nullptr) {
+    return ddwaf_object_invalid(object);
+  }
+  if (metrics) {
+    metrics->converted_nodes++;
+    metrics->converted_bytes += copied;
+    if (copied < length) {
+      metrics->max_truncated_string_length = std::max(metrics->max_truncated_string_length, length);
+      metrics->truncated_strings++;
+    }
+  }
+  return ddwaf_object_stringl_nc(object, str, copied);
+}
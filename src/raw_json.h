@@ -0,0 +1,40 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+#ifndef SRC_RAW_JSON_H_
+#define SRC_RAW_JSON_H_
+
+#include <napi.h>
+#include <ddwaf.h>
+
+#include "src/arena.h"
+#include "src/convert.h"
+#include "src/metrics.h"
+
+// Raw JSON bodies
+//
+// DDWAF.rawJson(body) wraps a JSON document, given as a string or as UTF-8 bytes, so that it can be used as the
+// value of an address of a run() payload. The document is parsed straight into ddwaf_object instead of going
+// through JSON.parse() and then the conversion of the resulting JS objects. The depth, container size and
+// string length limits of the address are applied while parsing. A body that is not valid JSON is passed to the
+// WAF as a plain string.
+
+// Returns an empty value when body is neither a string nor binary data
+Napi::Value make_raw_json(Napi::Env env, Napi::Value body);
+
+// Returns true and the wrapped body when value was created by make_raw_json
+bool get_raw_json(napi_env env, napi_value value, napi_value* body);
+
+ddwaf_object* to_ddwaf_raw_json(
+  ddwaf_object *object,
+  napi_env env,
+  napi_value body,
+  int depth,
+  const ConversionLimits &limits,
+  Arena *arena,
+  WAFTruncationMetrics *metrics,
+  ConversionBudget *budget
+);
+
+#endif  // SRC_RAW_JSON_H_
@@ -0,0 +1,117 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+
+#ifndef SRC_SHARED_HANDLE_H_
+#define SRC_SHARED_HANDLE_H_
+
+#include <ddwaf.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Builder and current handle of a ruleset. A DDWAF instance owns one, and the instances attached to it from other
+// threads with DDWAF.attach() share it, so the ruleset is compiled once per process and config updates made through
+// any instance are seen by all of them.
+//
+// builder_mutex serializes every use of the builder, from the update to the swap of the handle it built.
+// handle_mutex only guards reading and replacing the handle, so contexts can be created while a build is running.
+class SharedHandle {
+ public:
+  SharedHandle(ddwaf_builder builder, ddwaf_handle handle)
+    : _builder(builder), _handle(handle), _generation(0), _id(0) {}
+
+  ~SharedHandle() {
+    if (this->_id != 0) {
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      registry().erase(this->_id);
+    }
+    ddwaf_destroy(this->_handle);
+    ddwaf_builder_destroy(this->_builder);
+  }
+
+  SharedHandle(const SharedHandle&) = delete;
+  SharedHandle& operator=(const SharedHandle&) = delete;
+
+  // Must be held while calling builder()
+  std::mutex& builder_mutex() {
+    return this->_builder_mutex;
+  }
+
+  ddwaf_builder builder() const {
+    return this->_builder;
+  }
+
+  // Replaces the handle, the caller must hold builder_mutex so that handles are swapped in the order they were built.
+  // Contexts created from the previous handle stay valid, libddwaf keeps its ruleset alive until they are destroyed.
+  void swap(ddwaf_handle handle) {
+    ddwaf_handle previous;
+    {
+      std::lock_guard<std::mutex> lock(this->_handle_mutex);
+      previous = this->_handle;
+      this->_handle = handle;
+      this->_generation++;
+    }
+    // nobody reads a handle outside of handle_mutex
+    ddwaf_destroy(previous);
+  }
+
+  // Calls fn(handle, generation) with the current handle, which must not be kept after fn returns
+  template <typename Fn>
+  auto with_handle(Fn fn) -> decltype(fn(ddwaf_handle(), uint64_t())) {
+    std::lock_guard<std::mutex> lock(this->_handle_mutex);
+    return fn(this->_handle, this->_generation);
+  }
+
+  uint64_t generation() {
+    std::lock_guard<std::mutex> lock(this->_handle_mutex);
+    return this->_generation;
+  }
+
+  // Registers the handle in the process-wide registry, returns the id other threads attach with
+  static uint32_t Share(const std::shared_ptr<SharedHandle>& shared) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    if (shared->_id == 0) {
+      static uint32_t next_id = 0;
+      shared->_id = ++next_id;
+      registry()[shared->_id] = shared;
+    }
+    return shared->_id;
+  }
+
+  // Returns null when no instance using the handle is alive anymore
+  static std::shared_ptr<SharedHandle> Attach(uint32_t id) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    auto it = registry().find(id);
+    if (it == registry().end()) {
+      return nullptr;
+    }
+    return it->second.lock();
+  }
+
+ private:
+  // never destroyed, handles may outlive static destruction at exit
+  static std::mutex& registry_mutex() {
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+  }
+
+  // weak references, the registry does not keep a ruleset alive
+  static std::unordered_map<uint32_t, std::weak_ptr<SharedHandle>>& registry() {
+    static auto* handles = new std::unordered_map<uint32_t, std::weak_ptr<SharedHandle>>();
+    return *handles;
+  }
+
+  std::mutex _builder_mutex;
+  std::mutex _handle_mutex;
+  ddwaf_builder _builder;
+  ddwaf_handle _handle;
+  uint64_t _generation;
+  // 0 until shared, guarded by the registry mutex
+  uint32_t _id;
+};
+
+#endif  // SRC_SHARED_HANDLE_H_
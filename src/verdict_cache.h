@@ -0,0 +1,238 @@
+/**
+* Unless explicitly stated otherwise all files in this repository are licensed under the Apache-2.0 License.
+* This product includes software developed at Datadog (https://www.datadoghq.com/). Copyright 2021 Datadog, Inc.
+**/
+
+#ifndef SRC_VERDICT_CACHE_H_
+#define SRC_VERDICT_CACHE_H_
+
+#include <ddwaf.h>
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// SipHash-2-4 with a key drawn at random once per process, so that payloads with the same hash cannot be crafted
+// without knowing it. Data is fed in pieces with update(), the result only depends on the concatenated bytes.
+class SipHasher {
+ public:
+  explicit SipHasher(uint64_t seed) : _tail(0), _tail_length(0), _length(0) {
+    const uint64_t* key = process_key();
+    this->_v0 = 0x736f6d6570736575ULL ^ key[0];
+    this->_v1 = 0x646f72616e646f6dULL ^ key[1];
+    this->_v2 = 0x6c7967656e657261ULL ^ key[0];
+    this->_v3 = 0x7465646279746573ULL ^ key[1];
+    this->update_u64(seed);
+  }
+
+  void update(const char* data, size_t length) {
+    this->_length += length;
+    for (; length > 0 && this->_tail_length > 0; --length) {
+      this->push_byte(*data++);
+    }
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, data, sizeof(uint64_t));
+      this->compress(word);
+    }
+    for (; length > 0; --length) {
+      this->push_byte(*data++);
+    }
+  }
+
+  void update_u64(uint64_t value) {
+    this->update(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  uint64_t finish() {
+    uint64_t last = (this->_length << 56) | this->_tail;
+    this->compress(last);
+    this->_v2 ^= 0xff;
+    for (int i = 0; i < 4; ++i) {
+      this->round();
+    }
+    return this->_v0 ^ this->_v1 ^ this->_v2 ^ this->_v3;
+  }
+
+ private:
+  static const uint64_t* process_key() {
+    static const uint64_t* key = [] {
+      std::random_device random;
+      static uint64_t words[2];
+      for (uint64_t& word : words) {
+        word = (static_cast<uint64_t>(random()) << 32) ^ random();
+      }
+      return words;
+    }();
+    return key;
+  }
+
+  static uint64_t rotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+  }
+
+  void round() {
+    this->_v0 += this->_v1;
+    this->_v1 = rotate(this->_v1, 13) ^ this->_v0;
+    this->_v0 = rotate(this->_v0, 32);
+    this->_v2 += this->_v3;
+    this->_v3 = rotate(this->_v3, 16) ^ this->_v2;
+    this->_v0 += this->_v3;
+    this->_v3 = rotate(this->_v3, 21) ^ this->_v0;
+    this->_v2 += this->_v1;
+    this->_v1 = rotate(this->_v1, 17) ^ this->_v2;
+    this->_v2 = rotate(this->_v2, 32);
+  }
+
+  void compress(uint64_t word) {
+    this->_v3 ^= word;
+    this->round();
+    this->round();
+    this->_v0 ^= word;
+  }
+
+  void push_byte(char byte) {
+    this->_tail |= static_cast<uint64_t>(static_cast<unsigned char>(byte)) << (8 * this->_tail_length);
+    if (++this->_tail_length == sizeof(uint64_t)) {
+      this->compress(this->_tail);
+      this->_tail = 0;
+      this->_tail_length = 0;
+    }
+  }
+
+  uint64_t _v0;
+  uint64_t _v1;
+  uint64_t _v2;
+  uint64_t _v3;
+  // bytes of the word being filled, in the low bytes first
+  uint64_t _tail;
+  size_t _tail_length;
+  uint64_t _length;
+};
+
+// Appends what update() is given to a string
+struct ObjectSerializer {
+  std::string* out;
+
+  void update(const char* data, size_t length) {
+    this->out->append(data, length);
+  }
+
+  void update_u64(uint64_t value) {
+    this->update(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+};
+
+// Feeds a converted payload, keys included, to writer in an unambiguous form: two objects give the same bytes only
+// when they are equal. Its depth is bounded by the conversion limits.
+template <typename Writer>
+void write_object(const ddwaf_object* object, Writer* writer) {
+  writer->update_u64(object->type);
+  switch (object->type) {
+    case DDWAF_OBJ_STRING:
+      writer->update_u64(object->nbEntries);
+      writer->update(object->stringValue, object->nbEntries);
+      return;
+    case DDWAF_OBJ_SIGNED:
+    case DDWAF_OBJ_UNSIGNED:
+      writer->update_u64(object->uintValue);
+      return;
+    case DDWAF_OBJ_FLOAT: {
+      uint64_t bits;
+      memcpy(&bits, &object->f64, sizeof(bits));
+      writer->update_u64(bits);
+      return;
+    }
+    case DDWAF_OBJ_BOOL:
+      writer->update_u64(object->boolean ? 1 : 0);
+      return;
+    case DDWAF_OBJ_ARRAY:
+    case DDWAF_OBJ_MAP:
+      writer->update_u64(object->nbEntries);
+      for (uint64_t i = 0; i < object->nbEntries; ++i) {
+        const ddwaf_object* entry = &object->array[i];
+        if (object->type == DDWAF_OBJ_MAP) {
+          uint64_t key_length = entry->parameterName ? entry->parameterNameLength : 0;
+          writer->update_u64(key_length);
+          writer->update(entry->parameterName, key_length);
+        }
+        write_object(entry, writer);
+      }
+      return;
+    default:
+      return;
+  }
+}
+
+// Keyed hash of a converted payload, chained to seed
+inline uint64_t hash_object(const ddwaf_object* object, uint64_t seed) {
+  SipHasher hasher(seed);
+  write_object(object, &hasher);
+  return hasher.finish();
+}
+
+inline void serialize_object(const ddwaf_object* object, std::string* out) {
+  ObjectSerializer serializer{out};
+  write_object(object, &serializer);
+}
+
+// Bounded LRU of the payloads that did not match, see DDWAFOptions::verdict_cache_size. Entries are found by their
+// hash but only hit when the serialized payload and persistent fingerprint are the same, so that a hash collision
+// cannot skip the WAF. A verdict only holds for the ruleset it was computed with: entries are tagged with the handle
+// generation and the whole cache is dropped when a newer one shows up. Only used from the JS thread.
+class VerdictCache {
+ public:
+  explicit VerdictCache(uint32_t capacity) : _capacity(capacity), _generation(0) {}
+
+  bool lookup(uint64_t key, uint64_t fingerprint, const std::string& payload, uint64_t generation) {
+    if (generation != this->_generation) {
+      return false;
+    }
+    auto it = this->_index.find(key);
+    if (it == this->_index.end() || it->second->fingerprint != fingerprint || it->second->payload != payload) {
+      return false;
+    }
+    this->_entries.splice(this->_entries.begin(), this->_entries, it->second);
+    return true;
+  }
+
+  void insert(uint64_t key, uint64_t fingerprint, std::string payload, uint64_t generation) {
+    if (generation < this->_generation) {
+      // the context was created from a ruleset that has since been replaced
+      return;
+    }
+    if (generation > this->_generation) {
+      this->_entries.clear();
+      this->_index.clear();
+      this->_generation = generation;
+    }
+    if (this->_index.count(key) != 0) {
+      return;
+    }
+    if (this->_entries.size() >= this->_capacity) {
+      this->_index.erase(this->_entries.back().key);
+      this->_entries.pop_back();
+    }
+    this->_entries.push_front({key, fingerprint, std::move(payload)});
+    this->_index.emplace(key, this->_entries.begin());
+  }
+
+ private:
+  struct Entry {
+    uint64_t key;
+    uint64_t fingerprint;
+    std::string payload;
+  };
+
+  uint32_t _capacity;
+  uint64_t _generation;
+  // most recently used first
+  std::list<Entry> _entries;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> _index;
+};
+
+#endif  // SRC_VERDICT_CACHE_H_
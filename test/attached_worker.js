@@ -0,0 +1,34 @@
+'use strict'
+
+const { isMainThread, parentPort, workerData } = require('worker_threads')
+
+if (!isMainThread) {
+  const { DDWAF } = require('..')
+
+  const waf = DDWAF.attach(workerData.id)
+
+  const run = () => {
+    const context = waf.createContext()
+
+    const result = context.run({
+      persistent: {
+        value_attack: 'whatev'
+      }
+    }, 1e9)
+
+    context.dispose()
+
+    return {
+      status: result.status,
+      knownAddresses: [...waf.knownAddresses]
+    }
+  }
+
+  parentPort.postMessage(run())
+
+  // runs again once the parent updated the shared ruleset
+  parentPort.once('message', () => {
+    parentPort.postMessage(run())
+    waf.dispose()
+  })
+}
@@ -5,7 +5,7 @@
 const { it, describe } = require('mocha')
 const assert = require('assert')
 
-const { DDWAF } = require('..')
+const { DDWAF, encodePayload } = require('..')
 const pkg = require('../package.json')
 const rules = require('./rules.json')
 const processor = require('./processor.json')
@@ -61,94 +61,1278 @@ describe('DDWAF', () => {
     })
   })
 
+  it('should convert diagnostics once', () => {
+    const waf = new DDWAF(rules, 'recommended')
+
+    assert.strictEqual(waf.diagnostics, waf.diagnostics)
+
+    const diagnostics = waf.diagnostics
+    waf.createOrUpdateConfig(rules, 'config/update')
+    assert.notStrictEqual(waf.diagnostics, diagnostics)
+    assert.deepStrictEqual(waf.diagnostics, diagnostics)
+  })
+
+  it('should have a diagnostics summary', () => {
+    const waf = new DDWAF(rules, 'recommended')
+
+    assert.deepStrictEqual(waf.diagnosticsSummary, {
+      rulesetVersion: '1.3.1',
+      loaded: 10,
+      failed: 3,
+      skipped: 0,
+      errors: 2,
+      warnings: 0
+    })
+  })
+
+  it('should keep the diagnostics of each config path', () => {
+    const waf = new DDWAF(rules, 'recommended')
+
+    assert(waf.createOrUpdateConfig({
+      rules_data: [{ id: 'blocked_ips', type: 'ip_with_expiration', data: [{ value: '1.2.3.4' }] }]
+    }, 'config/data'))
+
+    assert.deepStrictEqual(waf.getConfigDiagnostics('recommended').rules.failed, ['invalid_1', 'invalid_2', 'invalid_3'])
+    assert.deepStrictEqual(waf.getConfigDiagnostics('config/data'), waf.diagnostics)
+    assert.strictEqual(waf.getConfigDiagnostics('config/unknown'), undefined)
+    assert.throws(() => waf.getConfigDiagnostics(), {
+      name: 'TypeError',
+      message: 'First argument must be a string'
+    })
+
+    assert(waf.removeConfig('config/data'))
+    assert.strictEqual(waf.getConfigDiagnostics('config/data'), undefined)
+    // the last update stays readable after its path is removed
+    assert.notStrictEqual(waf.diagnostics, undefined)
+  })
+
   it('should have knownAddresses', () => {
     const waf = new DDWAF(rules, 'recommended')
 
-    assert.deepStrictEqual(waf.knownAddresses, new Set([
-      'http.client_ip',
-      'server.request.headers.no_cookies',
-      'server.response.status',
-      'value_attack',
-      'key_attack',
-      'server.request.body',
-      'custom_value_attack'
-    ]))
-  })
+    assert.deepStrictEqual(waf.knownAddresses, new Set([
+      'http.client_ip',
+      'server.request.headers.no_cookies',
+      'server.response.status',
+      'value_attack',
+      'key_attack',
+      'server.request.body',
+      'custom_value_attack'
+    ]))
+  })
+
+  it('should have knownActions', () => {
+    const waf = new DDWAF(rules, 'recommended')
+
+    assert.deepStrictEqual(waf.knownActions, new Set([
+      'block_request'
+    ]))
+  })
+
+  it('should collect an attack and cleanup everything', () => {
+    const waf = new DDWAF(rules, 'recommended')
+    const context = waf.createContext()
+    const payload = {
+      persistent: {
+        'server.request.headers.no_cookies': 'value_ATTack',
+        x: new Array(4096).fill('x').join(''),
+        y: new Array(4097).fill('y').join(''),
+        z: new Array(4097).fill('z')
+      }
+    }
+
+    const result = context.run(payload, TIMEOUT)
+
+    assert.strictEqual(result.timeout, false)
+    assert.strictEqual(result.status, 'match')
+    assert(result.events)
+    assert.deepStrictEqual(result.actions, {})
+    assert(!context.disposed)
+
+    context.dispose()
+    assert(context.disposed)
+
+    assert.throws(() => {
+      context.run(payload, TIMEOUT)
+    }, new Error('Calling run on a disposed context'))
+    assert(!waf.disposed)
+
+    waf.dispose()
+    assert(waf.disposed)
+
+    assert.throws(() => {
+      waf.createContext()
+    }, new Error('Calling createContext on a disposed DDWAF instance'))
+  })
+
+  it('should collect different attacks on ephemeral addresses', () => {
+    const waf = new DDWAF(rules, 'recommended')
+    const context = waf.createContext()
+    let result = context.run({
+      ephemeral: {
+        'server.request.headers.no_cookies': 'value_ATTack'
+      }
+    }, TIMEOUT)
+
+    assert.strictEqual(result.timeout, false)
+    assert.strictEqual(result.status, 'match')
+    assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, 'value_attack')
+    assert.deepStrictEqual(result.actions, {})
+    assert.deepStrictEqual(result.metrics, {})
+
+    result = context.run({
+      ephemeral: {
+        'server.request.headers.no_cookies': 'other_attack'
+      }
+    }, TIMEOUT)
+
+    assert.strictEqual(result.timeout, false)
+    assert.strictEqual(result.status, 'match')
+    assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, 'other_attack')
+    assert.deepStrictEqual(result.actions, {})
+    assert.deepStrictEqual(result.metrics, {})
+
+    context.dispose()
+
+    waf.dispose()
+  })
+
+  describe('runAsync', () => {
+    it('should collect an attack asynchronously', async () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const result = await context.runAsync({
+        persistent: {
+          'server.request.headers.no_cookies': 'value_ATTack'
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.timeout, false)
+      assert.strictEqual(result.status, 'match')
+      assert(result.events)
+      assert.deepStrictEqual(result.actions, {})
+      assert.deepStrictEqual(result.metrics, {})
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should refuse to run while an async run is pending', async () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+      const payload = {
+        ephemeral: {
+          'server.request.headers.no_cookies': 'value_ATTack'
+        }
+      }
+
+      const pending = context.runAsync(payload, TIMEOUT)
+
+      const busyError = new Error('Calling run on a context with a pending runAsync')
+      assert.throws(() => context.run(payload, TIMEOUT), busyError)
+      assert.throws(() => context.runAsync(payload, TIMEOUT), busyError)
+
+      const result = await pending
+      assert.strictEqual(result.status, 'match')
+
+      const result2 = context.run(payload, TIMEOUT)
+      assert.strictEqual(result2.status, 'match')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should allow dispose while an async run is pending', async () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const pending = context.runAsync({
+        persistent: {
+          'server.request.headers.no_cookies': 'value_ATTack'
+        }
+      }, TIMEOUT)
+
+      context.dispose()
+      assert(context.disposed)
+
+      const result = await pending
+      assert.strictEqual(result.status, 'match')
+
+      assert.throws(() => context.runAsync({ persistent: {} }, TIMEOUT), new Error('Calling run on a disposed context'))
+
+      waf.dispose()
+    })
+  })
+
+  describe('Persistent memoization', () => {
+    it('should throw a type error on invalid memoizePersistent option', () => {
+      assert.throws(
+        () => new DDWAF(rules, 'recommended', { memoizePersistent: 'yes' }),
+        new TypeError('memoizePersistent must be a boolean')
+      )
+    })
+
+    it('should detect changes made in place to a persistent object', () => {
+      const waf = new DDWAF(rules, 'recommended', { memoizePersistent: true })
+      const context = waf.createContext()
+      const headers = { header: 'safe' }
+
+      const result1 = context.run({ persistent: { 'server.request.headers.no_cookies': headers } }, TIMEOUT)
+      assert(!result1.status)
+
+      const result2 = context.run({ persistent: { 'server.request.headers.no_cookies': headers } }, TIMEOUT)
+      assert(!result2.status)
+
+      // same object and same keys, only a value changed
+      headers.header = 'value_attack'
+      const result3 = context.run({ persistent: { 'server.request.headers.no_cookies': headers } }, TIMEOUT)
+      assert.strictEqual(result3.status, 'match')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should send again a persistent address whose conversion was cut short', () => {
+      const waf = new DDWAF(rules, 'recommended', { memoizePersistent: true })
+      const context = waf.createContext()
+
+      const body = {}
+      for (let i = 0; i < 255; ++i) {
+        body[`key${i}`] = new Array(256).fill('value')
+      }
+      body.key255 = '.htaccess'
+
+      const result1 = context.run({ persistent: { 'server.request.body': body } }, 1)
+      assert.strictEqual(result1.conversionTimeout, true)
+
+      const result2 = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert.strictEqual(result2.status, 'match')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should not parse again the raw JSON body last sent for a persistent address', () => {
+      const waf = new DDWAF(rules, 'recommended', { memoizePersistent: true })
+      const context = waf.createContext()
+      const json = `{"string":"${'a'.repeat(5000)}"}`
+      const body = DDWAF.rawJson(json)
+
+      const result1 = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert.strictEqual(result1.metrics.maxTruncatedString, 5000)
+
+      // skipped before parsing, so nothing is truncated
+      const result2 = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert(!('maxTruncatedString' in result2.metrics))
+
+      // a new wrapper of the same string is parsed again
+      const result3 = context.run({ persistent: { 'server.request.body': DDWAF.rawJson(json) } }, TIMEOUT)
+      assert.strictEqual(result3.metrics.maxTruncatedString, 5000)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should send again a raw JSON body after another value was sent for its address', () => {
+      const waf = new DDWAF(rules, 'recommended', { memoizePersistent: true })
+      const context = waf.createContext()
+      const body = DDWAF.rawJson(`{"string":"${'a'.repeat(5000)}"}`)
+
+      const result1 = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert.strictEqual(result1.metrics.maxTruncatedString, 5000)
+
+      context.run({ persistent: { 'server.request.body': { key: 'safe' } } }, TIMEOUT)
+
+      // the WAF now holds the object, the body is parsed and sent again
+      const result2 = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert.strictEqual(result2.metrics.maxTruncatedString, 5000)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should always convert buffer raw JSON bodies, which can change in place', () => {
+      const waf = new DDWAF(rules, 'recommended', { memoizePersistent: true })
+      const context = waf.createContext()
+      const buffer = Buffer.from('{"key":"safe_____"}')
+      const body = DDWAF.rawJson(buffer)
+
+      const result1 = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert(!result1.status)
+
+      buffer.write('.htaccess', 8)
+      const result2 = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert.strictEqual(result2.status, 'match')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should convert again a different persistent object', () => {
+      const waf = new DDWAF(rules, 'recommended', { memoizePersistent: true })
+      const context = waf.createContext()
+
+      const result1 = context.run({ persistent: { 'server.request.headers.no_cookies': { header: 'safe' } } }, TIMEOUT)
+      assert(!result1.status)
+
+      const result2 = context.run({
+        persistent: { 'server.request.headers.no_cookies': { header: 'value_attack' } }
+      }, TIMEOUT)
+      assert.strictEqual(result2.status, 'match')
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Lazy results', () => {
+    it('should throw a type error on invalid lazyResults option', () => {
+      assert.throws(
+        () => new DDWAF(rules, 'recommended', { lazyResults: 1 }),
+        new TypeError('lazyResults must be a boolean')
+      )
+    })
+
+    it('should convert result fields on first read', () => {
+      const waf = new DDWAF(rules, 'recommended', { lazyResults: true })
+      const context = waf.createContext()
+
+      const result = context.run({
+        persistent: {
+          custom_value_attack: 'match'
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(typeof Object.getOwnPropertyDescriptor(result, 'events').get, 'function')
+      assert.strictEqual(typeof Object.getOwnPropertyDescriptor(result, 'actions').get, 'function')
+
+      assert.deepStrictEqual(result.actions, {
+        block_request: {
+          security_response_id: result.actions.block_request.security_response_id,
+          grpc_status_code: 10,
+          status_code: 418,
+          type: 'auto'
+        }
+      })
+      assert.strictEqual(Object.getOwnPropertyDescriptor(result, 'actions').get, undefined)
+      assert.strictEqual(result.actions, result.actions)
+
+      assert.strictEqual(result.events[0].rule.id, 'custom_action_rule')
+      assert.strictEqual(Object.getOwnPropertyDescriptor(result, 'events').get, undefined)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should keep lazy getters safe to call on their own', () => {
+      const waf = new DDWAF(rules, 'recommended', { lazyResults: true })
+      const context = waf.createContext()
+
+      const result = context.run({
+        persistent: {
+          custom_value_attack: 'match'
+        }
+      }, TIMEOUT)
+
+      const getEvents = Object.getOwnPropertyDescriptor(result, 'events').get
+      const other = {}
+
+      // the field of the result the getter was defined on is converted, never the one of another object
+      const events = getEvents.call(other)
+      assert.strictEqual(events[0].rule.id, 'custom_action_rule')
+      assert(!('events' in other))
+      assert.strictEqual(Object.getOwnPropertyDescriptor(result, 'events').get, undefined)
+      assert.strictEqual(result.events, events)
+      assert.strictEqual(getEvents(), events)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should not define lazy fields without a match', () => {
+      const waf = new DDWAF(rules, 'recommended', { lazyResults: true })
+      const context = waf.createContext()
+
+      const result = context.run({
+        persistent: {
+          'server.request.headers.no_cookies': 'normal_value'
+        }
+      }, TIMEOUT)
+
+      assert(!result.status)
+      assert(!('events' in result))
+      assert(!('actions' in result))
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Batch runs', () => {
+    it('should throw on invalid arguments', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      assert.throws(() => context.runBatch([]), new Error('Wrong number of arguments, 2 expected'))
+      assert.throws(() => context.runBatch({}, TIMEOUT), new TypeError('Payloads must be an array'))
+      assert.throws(() => context.runBatch([{}], TIMEOUT), new TypeError('Persistent or ephemeral must be an object'))
+      assert.throws(() => context.runBatch([], 0), new TypeError('Timeout argument must be greater than 0'))
+      assert.throws(() => context.runBatch([], TIMEOUT, 1), new TypeError('shortCircuit must be a boolean'))
+
+      context.dispose()
+      assert.throws(() => context.runBatch([], TIMEOUT), new Error('Calling run on a disposed context'))
+
+      waf.dispose()
+    })
+
+    it('should return one result per payload', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const results = context.runBatch([
+        { ephemeral: { 'server.request.headers.no_cookies': 'normal_value' } },
+        { ephemeral: { 'server.request.headers.no_cookies': 'value_attack' } },
+        { ephemeral: { custom_value_attack: 'match' } }
+      ], TIMEOUT)
+
+      assert.strictEqual(results.length, 3)
+      assert(!results[0].status)
+      assert.strictEqual(results[1].status, 'match')
+      assert.strictEqual(results[1].events[0].rule.id, 'value_attack')
+      assert.strictEqual(results[2].status, 'match')
+      assert(results[2].actions.block_request)
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('runs')], 3n)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should only return the first match with shortCircuit', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const result = context.runBatch([
+        { ephemeral: { 'server.request.headers.no_cookies': 'normal_value' } },
+        { ephemeral: { 'server.request.headers.no_cookies': 'value_attack' } },
+        { ephemeral: { custom_value_attack: 'match' } }
+      ], TIMEOUT, true)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.index, 1)
+      assert.strictEqual(result.events[0].rule.id, 'value_attack')
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('runs')], 2n)
+
+      assert.strictEqual(context.runBatch([
+        { ephemeral: { 'server.request.headers.no_cookies': 'normal_value' } }
+      ], TIMEOUT, true), null)
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Streamed bodies', () => {
+    it('should throw when the calls are out of order', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      assert.throws(() => context.pushChunk('a'), new Error('Calling pushChunk before beginBody'))
+      assert.throws(() => context.endBody(), new Error('Calling endBody before beginBody'))
+
+      context.beginBody('server.request.body', TIMEOUT)
+      assert.throws(() => context.beginBody('server.request.body', TIMEOUT), new Error('Calling beginBody before endBody'))
+      assert.throws(() => context.pushChunk(1), new TypeError('Chunk must be a string or a Buffer'))
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should run on the whole body when it ends', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      context.beginBody('server.request.body', TIMEOUT)
+      assert.strictEqual(context.pushChunk('some .hta'), undefined)
+      assert.strictEqual(context.pushChunk(Buffer.from('ccess file')), undefined)
+
+      const result = context.endBody()
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, 'some .htaccess file')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should run once the inspection limit is reached and drop the rest', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      context.beginBody('server.request.body', TIMEOUT)
+      assert.strictEqual(context.pushChunk('a'.repeat(4000)), undefined)
+
+      const result = context.pushChunk('.htaccess'.repeat(20))
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.metrics.maxTruncatedString, 4000 + '.htaccess'.length * 20)
+
+      assert.strictEqual(context.pushChunk('.htaccess'), undefined)
+      assert.strictEqual(context.endBody(), undefined)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should not buffer bodies of addresses unknown to the ruleset', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      context.beginBody('unknown.address', TIMEOUT)
+      assert.strictEqual(context.pushChunk('a'.repeat(5000)), undefined)
+      assert.strictEqual(context.endBody(), undefined)
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('runs')], 0n)
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Context pool', () => {
+    it('should throw a type error on invalid contextPoolSize option', () => {
+      assert.throws(
+        () => new DDWAF(rules, 'recommended', { contextPoolSize: 'a' }),
+        new TypeError('contextPoolSize must be a positive number')
+      )
+      assert.throws(
+        () => new DDWAF(rules, 'recommended', { contextPoolSize: -1 }),
+        new TypeError('contextPoolSize must be a positive number')
+      )
+      assert.throws(
+        () => new DDWAF(rules, 'recommended', { contextPoolSize: 0 }),
+        new TypeError('contextPoolSize must be a positive number')
+      )
+      assert.throws(
+        () => new DDWAF(rules, 'recommended', { contextPoolSize: NaN }),
+        new TypeError('contextPoolSize must be a positive number')
+      )
+    })
+
+    it('should reuse the state of disposed contexts behind new objects', () => {
+      const waf = new DDWAF(rules, 'recommended', { contextPoolSize: 1 })
+
+      const context = waf.createContext()
+      assert(context.run({ persistent: { 'server.request.headers.no_cookies': 'value_attack' } }, TIMEOUT).status)
+      context.dispose()
+      assert(context.disposed)
+
+      const reused = waf.createContext()
+      assert.notStrictEqual(reused, context)
+      assert(!reused.disposed)
+
+      // a reference kept to the disposed context cannot run against the new one
+      assert(context.disposed)
+      assert.throws(
+        () => context.run({ persistent: { 'server.request.headers.no_cookies': 'value_attack' } }, TIMEOUT),
+        new Error('Calling run on a disposed context')
+      )
+
+      // nothing from the previous use is left in the context
+      const result = reused.run({ persistent: { 'server.request.headers.no_cookies': 'normal_value' } }, TIMEOUT)
+      assert(!result.status)
+      assert(reused.run({ persistent: { 'server.request.headers.no_cookies': 'value_attack' } }, TIMEOUT).status)
+
+      const other = waf.createContext()
+      assert.notStrictEqual(other, reused)
+
+      reused.dispose()
+      other.dispose()
+      waf.dispose()
+    })
+
+    it('should not reuse contexts across config updates', () => {
+      const waf = new DDWAF(rules, 'recommended', { contextPoolSize: 4 })
+
+      const context = waf.createContext()
+      context.dispose()
+
+      waf.createOrUpdateConfig(processor, 'processor_rules')
+
+      const fresh = waf.createContext()
+      assert.notStrictEqual(fresh, context)
+
+      fresh.dispose()
+      waf.dispose()
+    })
+
+    it('should not reuse contexts by default', () => {
+      const waf = new DDWAF(rules, 'recommended')
+
+      const context = waf.createContext()
+      context.dispose()
+
+      assert.notStrictEqual(waf.createContext(), context)
+
+      waf.dispose()
+    })
+  })
+
+  describe('Verdict cache', () => {
+    function counter (waf, name) {
+      return waf.counters[DDWAF.counterNames.indexOf(name)]
+    }
+
+    it('should throw a type error on invalid verdictCacheSize option', () => {
+      assert.throws(
+        () => new DDWAF(rules, 'recommended', { verdictCacheSize: 'a' }),
+        new TypeError('verdictCacheSize must be a positive number')
+      )
+    })
+
+    it('should skip the WAF for ephemeral payloads that did not match before', () => {
+      const waf = new DDWAF(rules, 'recommended', { verdictCacheSize: 16 })
+      const payload = { ephemeral: { 'server.request.headers.no_cookies': 'normal_value' } }
+
+      const context1 = waf.createContext()
+      assert(!context1.run(payload, TIMEOUT).status)
+      assert(!context1.run(payload, TIMEOUT).status)
+
+      const context2 = waf.createContext()
+      assert(!context2.run(payload, TIMEOUT).status)
+
+      assert.strictEqual(counter(waf, 'cacheMisses'), 1n)
+      assert.strictEqual(counter(waf, 'cacheHits'), 2n)
+      assert.strictEqual(counter(waf, 'runs'), 1n)
+
+      // matches are never cached
+      const attack = { ephemeral: { 'server.request.headers.no_cookies': 'value_attack' } }
+      assert.strictEqual(context2.run(attack, TIMEOUT).status, 'match')
+      assert.strictEqual(context1.run(attack, TIMEOUT).status, 'match')
+
+      context1.dispose()
+      context2.dispose()
+      waf.dispose()
+    })
+
+    it('should not share verdicts between contexts with different persistent data', () => {
+      const waf = new DDWAF(rules, 'recommended', { verdictCacheSize: 16 })
+      const payload = { ephemeral: { 'server.request.headers.no_cookies': 'normal_value' } }
+
+      const context1 = waf.createContext()
+      context1.run(payload, TIMEOUT)
+
+      const context2 = waf.createContext()
+      context2.run({ persistent: { 'server.request.headers.no_cookies': 'other_value' } }, TIMEOUT)
+      context2.run(payload, TIMEOUT)
+
+      assert.strictEqual(counter(waf, 'cacheHits'), 0n)
+      assert.strictEqual(counter(waf, 'cacheMisses'), 2n)
+
+      context1.dispose()
+      context2.dispose()
+      waf.dispose()
+    })
+
+    it('should not share verdicts with contexts that received a streamed body', () => {
+      const combined = {
+        version: '2.2',
+        metadata: { rules_version: '1.0.0' },
+        rules: [{
+          id: 'body_and_header',
+          name: 'body and header',
+          tags: { type: 'attack', category: 'attack_attempt' },
+          conditions: [
+            {
+              parameters: { inputs: [{ address: 'server.request.body' }], regex: 'body_attack' },
+              operator: 'match_regex'
+            },
+            {
+              parameters: { inputs: [{ address: 'server.request.headers.no_cookies' }], regex: 'header_attack' },
+              operator: 'match_regex'
+            }
+          ],
+          transformers: []
+        }]
+      }
+      const waf = new DDWAF(combined, 'combined', { verdictCacheSize: 16 })
+      const payload = { ephemeral: { 'server.request.headers.no_cookies': 'header_attack' } }
+
+      const context1 = waf.createContext()
+      assert(!context1.run(payload, TIMEOUT).status)
+
+      const context2 = waf.createContext()
+      context2.beginBody('server.request.body', TIMEOUT)
+      context2.pushChunk('body_attack')
+      assert(!context2.endBody().status)
+      assert.strictEqual(context2.run(payload, TIMEOUT).status, 'match')
+
+      assert.strictEqual(counter(waf, 'cacheHits'), 0n)
+
+      context1.dispose()
+      context2.dispose()
+      waf.dispose()
+    })
+
+    it('should drop the verdicts on config updates', () => {
+      const waf = new DDWAF(rules, 'recommended', { verdictCacheSize: 16 })
+      const payload = { ephemeral: { 'server.request.headers.no_cookies': 'normal_value' } }
+
+      const context1 = waf.createContext()
+      context1.run(payload, TIMEOUT)
+      context1.dispose()
+
+      waf.createOrUpdateConfig(processor, 'processor_rules')
+
+      const context2 = waf.createContext()
+      context2.run(payload, TIMEOUT)
+      context2.dispose()
+
+      assert.strictEqual(counter(waf, 'cacheHits'), 0n)
+      assert.strictEqual(counter(waf, 'cacheMisses'), 2n)
+
+      waf.dispose()
+    })
+  })
+
+  describe('Counters', () => {
+    function readCounters (waf) {
+      const counters = {}
+      DDWAF.counterNames.forEach((name, i) => {
+        counters[name] = waf.counters[i]
+      })
+      return counters
+    }
+
+    it('should expose one counter per name', () => {
+      const waf = new DDWAF(rules, 'recommended')
+
+      assert(waf.counters instanceof BigUint64Array)
+      assert.strictEqual(waf.counters.length, DDWAF.counterNames.length)
+      assert(waf.counters.every(value => value === 0n))
+      assert(Object.isFrozen(DDWAF.counterNames))
+
+      waf.dispose()
+    })
+
+    it('should accumulate the runs of every context', async () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const counters = waf.counters
+
+      const context1 = waf.createContext()
+      context1.run({ persistent: { 'server.request.headers.no_cookies': 'value_attack' } }, TIMEOUT)
+      context1.run({ ephemeral: { 'server.request.body': { key: 'a'.repeat(5000) } } }, TIMEOUT)
+
+      const context2 = waf.createContext()
+      await context2.runAsync({ persistent: { 'server.request.headers.no_cookies': 'normal_value' } }, TIMEOUT)
+
+      const values = readCounters(waf)
+      assert.strictEqual(values.runs, 3n)
+      assert.strictEqual(values.matches, 1n)
+      assert.strictEqual(values.timeouts, 0n)
+      assert.strictEqual(values.truncatedStrings, 1n)
+      assert.strictEqual(values.convertedNodes, 4n)
+      assert(values.convertedBytes > 4096n)
+      assert(values.conversionNs > 0n)
+      assert(values.wafNs > 0n)
+
+      // the same view is updated in place
+      assert.strictEqual(counters, waf.counters)
+      context1.dispose()
+      context2.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Known address filtering', () => {
+    it('should skip addresses unknown to the ruleset', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      assert(!waf.knownAddresses.has('unknown.address'))
+
+      const result = context.run({
+        persistent: {
+          'unknown.address': 'value_attack',
+          'server.request.headers.no_cookies': 'value_attack'
+        },
+        ephemeral: {
+          'other.unknown.address': { key: 'value' }
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.metrics.skippedAddresses, 2)
+      assert(!('skippedBytes' in result.metrics))
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should not read the value of addresses unknown to the ruleset', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      let reads = 0
+      const payload = { 'server.request.headers.no_cookies': 'value_attack' }
+      Object.defineProperty(payload, 'unknown.address', {
+        enumerable: true,
+        get () {
+          reads++
+          return 'value'
+        }
+      })
+
+      const result = context.run({ ephemeral: payload }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.metrics.skippedAddresses, 1)
+      assert.strictEqual(reads, 0)
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Conversion timeout', () => {
+    it('should report the conversion duration', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const result = context.run({
+        persistent: {
+          'server.request.headers.no_cookies': 'value_attack'
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert(result.conversionDuration > 0)
+      assert(!('conversionTimeout' in result))
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should cut the conversion short when the timeout is exhausted', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const body = {}
+      for (let i = 0; i < 256; ++i) {
+        body[`key${i}`] = new Array(256).fill('value')
+      }
+
+      const result = context.run({
+        persistent: {
+          'server.request.body': body
+        }
+      }, 1)
+
+      assert.strictEqual(result.conversionTimeout, true)
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('conversionTimeouts')], 1n)
+      assert(waf.counters[DDWAF.counterNames.indexOf('convertedNodes')] < 256n * 256n)
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Conversion limits', () => {
+    function nested (depth, leaf) {
+      return depth === 0 ? leaf : { child: nested(depth - 1, leaf) }
+    }
+
+    it('should throw a type error on invalid options', () => {
+      assert.throws(() => new DDWAF(rules, 'recommended', { addressLimits: [] }),
+        new TypeError('addressLimits must be an object'))
+      assert.throws(() => new DDWAF(rules, 'recommended', { addressLimits: { 'server.request.body': 20 } }),
+        new TypeError('addressLimits values must be objects'))
+      assert.throws(() => new DDWAF(rules, 'recommended', {
+        addressLimits: { 'server.request.body': { maxStringLength: 0 } }
+      }), new TypeError('maxStringLength must be a positive number'))
+      assert.throws(() => new DDWAF(rules, 'recommended', {
+        addressLimits: { 'server.request.body': { maxContainerSize: NaN } }
+      }), new TypeError('maxContainerSize must be a positive number'))
+      assert.throws(() => new DDWAF(rules, 'recommended', {
+        addressLimits: { 'server.request.body': { maxStringLength: 2 ** 32 } }
+      }), new TypeError('maxStringLength must not be above 16777216'))
+      assert.throws(() => new DDWAF(rules, 'recommended', {
+        addressLimits: { 'server.request.body': { maxContainerDepth: 257 } }
+      }), new TypeError('maxContainerDepth must not be above 256'))
+      assert.throws(() => new DDWAF(rules, 'recommended', { maxConvertedNodes: -1 }),
+        new TypeError('maxConvertedNodes must be a positive number'))
+      assert.throws(() => new DDWAF(rules, 'recommended', { maxConvertedBytes: '1' }),
+        new TypeError('maxConvertedBytes must be a positive number'))
+    })
+
+    it('should apply the limits configured for an address', () => {
+      const waf = new DDWAF(rules, 'recommended', {
+        addressLimits: {
+          'server.request.body': { maxContainerDepth: 40 },
+          'server.request.headers.no_cookies': { maxStringLength: 5 }
+        }
+      })
+      const context = waf.createContext()
+
+      const deep = context.run({ ephemeral: { 'server.request.body': nested(30, '.htaccess') } }, TIMEOUT)
+      assert.strictEqual(deep.status, 'match')
+      assert.deepStrictEqual(deep.metrics, {})
+
+      const tight = context.run({
+        ephemeral: {
+          'server.request.headers.no_cookies': 'value_attack',
+          'server.request.body': { string: 'a'.repeat(5000) }
+        }
+      }, TIMEOUT)
+      assert(!tight.status)
+      assert.strictEqual(tight.metrics.maxTruncatedString, 5000)
+      assert.deepStrictEqual(tight.metrics.truncatedAddresses, {
+        'server.request.headers.no_cookies': { maxTruncatedString: 'value_attack'.length },
+        'server.request.body': { maxTruncatedString: 5000 }
+      })
+
+      const body = DDWAF.rawJson(JSON.stringify(nested(30, '.htaccess')))
+      assert.strictEqual(context.run({ ephemeral: { 'server.request.body': body } }, TIMEOUT).status, 'match')
+
+      const encoded = encodePayload({ 'server.request.body': nested(30, '.htaccess') }, 40)
+      assert.strictEqual(context.run({ ephemeral: encoded }, TIMEOUT).status, 'match')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should convert addresses nested up to the highest depth limit', () => {
+      const waf = new DDWAF(rules, 'recommended', {
+        addressLimits: { 'server.request.body': { maxContainerDepth: 256 } }
+      })
+      const context = waf.createContext()
+
+      const deep = context.run({ ephemeral: { 'server.request.body': nested(250, '.htaccess') } }, TIMEOUT)
+      assert.strictEqual(deep.status, 'match')
+      assert.deepStrictEqual(deep.metrics, {})
+
+      const body = DDWAF.rawJson(JSON.stringify(nested(250, '.htaccess')))
+      assert.strictEqual(context.run({ ephemeral: { 'server.request.body': body } }, TIMEOUT).status, 'match')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should keep the default limits for the other addresses', () => {
+      const waf = new DDWAF(rules, 'recommended', {
+        addressLimits: { 'server.request.body': { maxContainerDepth: 40 } }
+      })
+      const context = waf.createContext()
+
+      const result = context.run({
+        ephemeral: { 'server.request.headers.no_cookies': nested(30, 'value_attack') }
+      }, TIMEOUT)
+
+      assert(!result.status)
+      assert.strictEqual(result.metrics.maxTruncatedContainerDepth, 20)
+      assert.deepStrictEqual(Object.keys(result.metrics.truncatedAddresses), ['server.request.headers.no_cookies'])
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should stop converting a payload past maxConvertedNodes', () => {
+      const waf = new DDWAF(rules, 'recommended', { maxConvertedNodes: 100 })
+      const context = waf.createContext()
+
+      const result = context.run({
+        persistent: {
+          'server.request.headers.no_cookies': 'value_attack',
+          'server.request.body': new Array(256).fill('value')
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.conversionOverBudget, true)
+      assert(!('conversionTimeout' in result))
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('conversionsOverBudget')], 1n)
+      assert(waf.counters[DDWAF.counterNames.indexOf('convertedNodes')] <= 101n)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should stop converting a payload past maxConvertedBytes', () => {
+      const waf = new DDWAF(rules, 'recommended', { maxConvertedBytes: 1000 })
+      const context = waf.createContext()
+
+      const result = context.run({
+        ephemeral: {
+          'server.request.body': new Array(256).fill('a'.repeat(100))
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.conversionOverBudget, true)
+      assert(waf.counters[DDWAF.counterNames.indexOf('convertedBytes')] < 1200n)
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Overload protection', () => {
+    it('should throw a type error on invalid options', () => {
+      assert.throws(() => new DDWAF(rules, 'recommended', { overload: true }),
+        new TypeError('overload must be an object'))
+      assert.throws(() => new DDWAF(rules, 'recommended', { overload: {} }),
+        new TypeError('cpuBudget must be a positive number'))
+      assert.throws(() => new DDWAF(rules, 'recommended', { overload: { cpuBudget: 1000, lagThreshold: -1 } }),
+        new TypeError('lagThreshold must be a positive number'))
+      assert.throws(() => new DDWAF(rules, 'recommended', { overload: { cpuBudget: 1000, degradedAddresses: [1] } }),
+        new TypeError('degradedAddresses must be an array of strings'))
+    })
+
+    it('should expose its state', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      assert.strictEqual(waf.overload, null)
+      waf.dispose()
+
+      const guarded = new DDWAF(rules, 'recommended', { overload: { cpuBudget: 100000 } })
+      const context = guarded.createContext()
+      context.run({ ephemeral: { 'server.request.headers.no_cookies': 'value_attack' } }, TIMEOUT)
+
+      assert(guarded.overload.remainingBudget < 100000)
+      assert(guarded.overload.averageRunCost > 0)
+      assert.strictEqual(typeof guarded.overload.averageLoopLag, 'number')
+
+      context.dispose()
+      guarded.dispose()
+    })
+
+    it('should skip runs once the budget is spent', () => {
+      const waf = new DDWAF(rules, 'recommended', { overload: { cpuBudget: 1 } })
+      const context = waf.createContext()
+
+      const payload = { ephemeral: { 'server.request.headers.no_cookies': 'value_attack' } }
+
+      assert.strictEqual(context.run(payload, TIMEOUT).status, 'match')
+
+      const result = context.run(payload, TIMEOUT)
+      assert(!result.status)
+      assert(!result.events)
+      assert.strictEqual(result.metrics.overload, 'skipped')
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('skippedRuns')], 1n)
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('runs')], 1n)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should only convert the degraded addresses while the event loop lags', () => {
+      const waf = new DDWAF(rules, 'recommended', { overload: { cpuBudget: 1000000, lagThreshold: 1 } })
+      const context = waf.createContext()
+
+      // blocks the current event loop iteration
+      const start = Date.now()
+      while (Date.now() - start < 50);
+
+      const result = context.run({
+        ephemeral: {
+          'server.request.headers.no_cookies': 'value_attack',
+          'server.request.body': '.htaccess'
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.metrics.overload, 'degraded')
+      assert.strictEqual(result.metrics.shedAddresses, 1)
+      assert.strictEqual(waf.counters[DDWAF.counterNames.indexOf('degradedRuns')], 1n)
+
+      context.dispose()
+      waf.dispose()
+    })
+  })
+
+  describe('Encoded payloads', () => {
+    it('should throw a type error when encoding something else than an object', () => {
+      assert.throws(() => encodePayload('string'), new TypeError('Addresses must be an object'))
+      assert.throws(() => encodePayload([]), new TypeError('Addresses must be an object'))
+    })
+
+    it('should match like the same payload given as an object', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const payload = {
+        'server.request.headers.no_cookies': 'value_attack',
+        'server.request.body': { a: [1, 1.5, true, null, undefined, Buffer.from('b')] }
+      }
+
+      const expected = context.run({ ephemeral: payload }, TIMEOUT)
+      const result = context.run({ ephemeral: encodePayload(payload) }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.deepStrictEqual(result.events, expected.events)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should accept an ArrayBuffer', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
 
-  it('should have knownActions', () => {
-    const waf = new DDWAF(rules, 'recommended')
+      const encoded = encodePayload({ 'server.request.headers.no_cookies': 'value_attack' })
+      const buffer = encoded.buffer.slice(encoded.byteOffset, encoded.byteOffset + encoded.byteLength)
 
-    assert.deepStrictEqual(waf.knownActions, new Set([
-      'block_request'
-    ]))
-  })
+      assert.strictEqual(context.run({ persistent: buffer }, TIMEOUT).status, 'match')
 
-  it('should collect an attack and cleanup everything', () => {
-    const waf = new DDWAF(rules, 'recommended')
-    const context = waf.createContext()
-    const payload = {
-      persistent: {
-        'server.request.headers.no_cookies': 'value_ATTack',
-        x: new Array(4096).fill('x').join(''),
-        y: new Array(4097).fill('y').join(''),
-        z: new Array(4097).fill('z')
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should apply the truncation limits and report them', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const result = context.run({
+        ephemeral: encodePayload({
+          'server.request.body': {
+            string: 'a'.repeat(5000),
+            array: new Array(300).fill('value'),
+            nested: nested(30)
+          }
+        })
+      }, TIMEOUT)
+
+      assert.strictEqual(result.metrics.maxTruncatedString, 5000)
+      assert.strictEqual(result.metrics.maxTruncatedContainerSize, 300)
+      assert.strictEqual(result.metrics.maxTruncatedContainerDepth, 20)
+
+      context.dispose()
+      waf.dispose()
+
+      function nested (depth) {
+        return depth === 0 ? 'leaf' : { child: nested(depth - 1) }
       }
-    }
+    })
 
-    const result = context.run(payload, TIMEOUT)
+    it('should skip unknown addresses', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
 
-    assert.strictEqual(result.timeout, false)
-    assert.strictEqual(result.status, 'match')
-    assert(result.events)
-    assert.deepStrictEqual(result.actions, {})
-    assert(!context.disposed)
+      const result = context.run({
+        persistent: encodePayload({
+          'unknown.address': 'value_attack',
+          'server.request.headers.no_cookies': 'value_attack'
+        })
+      }, TIMEOUT)
 
-    context.dispose()
-    assert(context.disposed)
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.metrics.skippedAddresses, 1)
+      // tag, length and bytes of the string
+      assert.strictEqual(result.metrics.skippedBytes, 1 + 4 + 'value_attack'.length)
 
-    assert.throws(() => {
-      context.run(payload, TIMEOUT)
-    }, new Error('Calling run on a disposed context'))
-    assert(!waf.disposed)
+      context.dispose()
+      waf.dispose()
+    })
 
-    waf.dispose()
-    assert(waf.disposed)
+    it('should throw a type error on malformed data', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
 
-    assert.throws(() => {
-      waf.createContext()
-    }, new Error('Calling createContext on a disposed DDWAF instance'))
+      const encoded = encodePayload({ 'server.request.headers.no_cookies': 'value_attack' })
+
+      assert.throws(
+        () => context.run({ ephemeral: encoded.subarray(0, encoded.length - 1) }, TIMEOUT),
+        new TypeError('Invalid encoded ephemeral payload')
+      )
+      assert.throws(
+        () => context.run({ ephemeral: Buffer.concat([encoded, Buffer.from([0x00])]) }, TIMEOUT),
+        new TypeError('Invalid encoded ephemeral payload')
+      )
+      assert.throws(
+        () => context.run({ persistent: Buffer.from('not a payload') }, TIMEOUT),
+        new TypeError('Invalid encoded persistent payload')
+      )
+
+      context.dispose()
+      waf.dispose()
+    })
   })
 
-  it('should collect different attacks on ephemeral addresses', () => {
-    const waf = new DDWAF(rules, 'recommended')
-    const context = waf.createContext()
-    let result = context.run({
-      ephemeral: {
-        'server.request.headers.no_cookies': 'value_ATTack'
+  describe('Raw JSON bodies', () => {
+    it('should throw a type error when wrapping something else than a string or a Buffer', () => {
+      assert.throws(() => DDWAF.rawJson({}), new TypeError('First argument must be a string or a Buffer'))
+      assert.throws(() => DDWAF.rawJson(), new TypeError('First argument must be a string or a Buffer'))
+    })
+
+    it('should match like the parsed body', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const body = JSON.stringify({ a: [1, '.htaccess', true, null], b: { c: 'é\u{1F600}' } })
+
+      const expected = context.run({ ephemeral: { 'server.request.body': JSON.parse(body) } }, TIMEOUT)
+      assert.strictEqual(expected.status, 'match')
+
+      for (const raw of [body, Buffer.from(body)]) {
+        const result = context.run({ ephemeral: { 'server.request.body': DDWAF.rawJson(raw) } }, TIMEOUT)
+
+        assert.strictEqual(result.status, 'match')
+        assert.deepStrictEqual(result.events, expected.events)
       }
-    }, TIMEOUT)
 
-    assert.strictEqual(result.timeout, false)
-    assert.strictEqual(result.status, 'match')
-    assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, 'value_attack')
-    assert.deepStrictEqual(result.actions, {})
-    assert.deepStrictEqual(result.metrics, {})
+      context.dispose()
+      waf.dispose()
+    })
 
-    result = context.run({
-      ephemeral: {
-        'server.request.headers.no_cookies': 'other_attack'
+    it('should apply the truncation limits while parsing', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      let nested = '"leaf"'
+      for (let i = 0; i < 30; ++i) {
+        nested = `{"child":${nested}}`
       }
-    }, TIMEOUT)
 
-    assert.strictEqual(result.timeout, false)
-    assert.strictEqual(result.status, 'match')
-    assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, 'other_attack')
-    assert.deepStrictEqual(result.actions, {})
-    assert.deepStrictEqual(result.metrics, {})
+      const body = `{"string":"${'a'.repeat(5000)}","array":[${new Array(300).fill('1').join(',')}],"nested":${nested}}`
 
-    context.dispose()
+      const result = context.run({ ephemeral: { 'server.request.body': DDWAF.rawJson(body) } }, TIMEOUT)
 
-    waf.dispose()
+      assert.strictEqual(result.metrics.maxTruncatedString, 5000)
+      assert.strictEqual(result.metrics.maxTruncatedContainerSize, 300)
+      assert.strictEqual(result.metrics.maxTruncatedContainerDepth, 20)
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should pass invalid JSON as a string', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      const result = context.run({
+        persistent: { 'server.request.headers.no_cookies': DDWAF.rawJson('{ value_attack') }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, '{ value_attack')
+
+      context.dispose()
+      waf.dispose()
+    })
+
+    it('should validate the values it does not build', () => {
+      const waf = new DDWAF(rules, 'recommended')
+      const context = waf.createContext()
+
+      // past the depth limit
+      for (const invalid of ['[1 2]', '{"a"}', '[,,]', '{"a":1,}', '["\\x"]']) {
+        const body = `{"deep":${'['.repeat(25)}${invalid}${']'.repeat(25)},"b":"value_attack"}`
+        const result = context.run({
+          ephemeral: { 'server.request.headers.no_cookies': DDWAF.rawJson(body) }
+        }, TIMEOUT)
+
+        assert.strictEqual(result.status, 'match')
+        assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, body)
+      }
+
+      context.dispose()
+      waf.dispose()
+    })
   })
 
   describe('WAF update', () => {
@@ -291,6 +1475,120 @@ describe('DDWAF', () => {
       })
     })
 
+    describe('Batch config updates', () => {
+      it('should throw a type error on invalid operations', () => {
+        const waf = new DDWAF(rules, 'recommended')
+        assert.throws(() => waf.applyConfigs({}), new TypeError('First argument must be an array'))
+        assert.throws(
+          () => waf.applyConfigs([{ config: processor }]),
+          new TypeError('Each operation must be an object with a string path')
+        )
+        assert.throws(
+          () => waf.applyConfigs([{ path: 'processor_rules', config: 'rules' }]),
+          new TypeError('Operation config must be an object')
+        )
+        assert.deepStrictEqual(waf.configPaths, ['recommended'])
+        waf.dispose()
+      })
+
+      it('should apply every operation and report each result', () => {
+        const waf = new DDWAF(rules, 'recommended')
+
+        const results = waf.applyConfigs([
+          { path: 'processor_rules', config: processor },
+          { path: 'config/broken', config: { rules: [{ name: 'rule_with_missing_id' }] } },
+          { path: 'config/missing' },
+          { path: 'recommended' }
+        ])
+
+        assert.strictEqual(results.length, 4)
+        assert.deepStrictEqual(results.map(({ path, success }) => ({ path, success })), [
+          { path: 'processor_rules', success: true },
+          { path: 'config/broken', success: false },
+          { path: 'config/missing', success: false },
+          { path: 'recommended', success: true }
+        ])
+        assert(results[0].diagnostics.processors.loaded.includes('processor-001'))
+        assert(!('diagnostics' in results[2]))
+
+        assert.deepStrictEqual(waf.configPaths, ['processor_rules'])
+        assert(waf.knownAddresses.has('waf.context.processor'))
+        assert(!waf.knownAddresses.has('server.request.headers.no_cookies'))
+
+        waf.dispose()
+      })
+    })
+
+    describe('Async config updates', () => {
+      it('should throw a type error on invalid arguments', () => {
+        const waf = new DDWAF(rules, 'recommended')
+        assert.throws(
+          () => waf.createOrUpdateConfigAsync('string', 'config/update'),
+          new TypeError('First argument must be an object')
+        )
+        assert.throws(
+          () => waf.removeConfigAsync(null),
+          new TypeError('First argument must be a string')
+        )
+        waf.dispose()
+      })
+
+      it('should only swap the handle once the build completes', async () => {
+        const waf = new DDWAF(rules, 'recommended')
+        const context = waf.createContext()
+
+        const promise = waf.createOrUpdateConfigAsync(processor, 'processor_rules')
+        assert(!waf.knownAddresses.has('waf.context.processor'))
+        assert.throws(
+          () => waf.createOrUpdateConfig(processor, 'processor_rules'),
+          new Error('Calling createOrUpdateConfig with a pending config update')
+        )
+
+        assert.strictEqual(await promise, true)
+        assert(waf.knownAddresses.has('waf.context.processor'))
+        assert(waf.configPaths.includes('processor_rules'))
+
+        // contexts created before the update keep working
+        const result = context.run({
+          persistent: {
+            'server.request.headers.no_cookies': 'value_attack'
+          }
+        }, TIMEOUT)
+        assert.strictEqual(result.status, 'match')
+
+        context.dispose()
+        waf.dispose()
+      })
+
+      it('should apply queued updates in order', async () => {
+        const waf = new DDWAF(rules, 'recommended')
+
+        const results = await Promise.all([
+          waf.createOrUpdateConfigAsync(processor, 'processor_rules'),
+          waf.removeConfigAsync('processor_rules'),
+          waf.removeConfigAsync('config/update')
+        ])
+
+        assert.deepStrictEqual(results, [true, true, false])
+        assert.deepStrictEqual(waf.configPaths, ['recommended'])
+        assert(!waf.knownAddresses.has('waf.context.processor'))
+
+        waf.dispose()
+      })
+
+      it('should reject queued updates when disposed', async () => {
+        const waf = new DDWAF(rules, 'recommended')
+
+        const first = waf.createOrUpdateConfigAsync(processor, 'processor_rules')
+        const second = waf.removeConfigAsync('processor_rules')
+        waf.dispose()
+
+        assert.strictEqual(waf.disposed, true)
+        assert.strictEqual(await first, true)
+        await assert.rejects(second, new Error('DDWAF instance disposed before the config update'))
+      })
+    })
+
     describe('Config paths', () => {
       it('should have no loaded configuration paths on WAF disposed instance', () => {
         const waf = new DDWAF(rules, 'recommended')
@@ -1270,6 +2568,33 @@ describe('limit tests', () => {
     })
   })
 
+  it('should only convert own enumerable string keys', () => {
+    const waf = new DDWAF(processor, 'processor_rules')
+    const context = waf.createContext()
+
+    const payload = Object.create({ inherited: 'value' })
+    payload.own = 'value'
+    payload[Symbol('symbol')] = 'value'
+    Object.defineProperty(payload, 'hidden', { value: 'value', enumerable: false })
+    Object.defineProperty(payload, 'throwing', {
+      enumerable: true,
+      get () {
+        throw new Error('getter error')
+      }
+    })
+
+    const result = context.run({
+      persistent: {
+        'server.request.body': payload,
+        'waf.context.processor': { 'extract-schema': true }
+      }
+    }, TIMEOUT)
+
+    assert.deepStrictEqual(result.attributes, {
+      'server.request.body.schema': [{ own: [8] }]
+    })
+  })
+
   it('should not match an extremely deeply nested object', () => {
     const waf = new DDWAF(rules, 'recommended')
     const context = waf.createContext()
@@ -1369,6 +2694,26 @@ describe('limit tests', () => {
     assert(result2.events)
   })
 
+  it('should convert every entry of wide containers', () => {
+    const waf = new DDWAF(rules, 'recommended')
+
+    const items = new Array(250).fill('not_an_attack')
+    items[200] = '.htaccess'
+
+    const entries = {}
+    for (let i = 0; i < 250; ++i) {
+      entries[`key${i}`] = i === 200 ? { toJSON: () => [{ path: '.htaccess' }] } : 'not_an_attack'
+    }
+
+    for (const body of [items, entries]) {
+      const context = waf.createContext()
+      const result = context.run({ persistent: { 'server.request.body': body } }, TIMEOUT)
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, '.htaccess')
+      context.dispose()
+    }
+  })
+
   it('should work with array/object changes in toJSON', () => {
     const a1 = ['val']
     a1.toJSON = function () {
@@ -1553,6 +2898,65 @@ describe('limit tests', () => {
     assert.strictEqual(result2.metrics.maxTruncatedString, 5001)
   })
 
+  it('should report the UTF-8 length of truncated multi-byte strings', () => {
+    const waf = new DDWAF(rules, 'recommended')
+    const context = waf.createContext()
+
+    const result = context.run({
+      persistent: {
+        'server.request.body': {
+          short: 'é'.repeat(2000),
+          long: 'é'.repeat(3000),
+          huge: 'a'.repeat(10 * 1024 * 1024)
+        }
+      }
+    }, TIMEOUT)
+
+    assert(!result.status)
+    assert.strictEqual(result.metrics.maxTruncatedString, 10 * 1024 * 1024)
+
+    const result2 = context.run({
+      persistent: {
+        'server.request.body': 'é'.repeat(3000)
+      }
+    }, TIMEOUT)
+
+    assert.strictEqual(result2.metrics.maxTruncatedString, 6000)
+  })
+
+  it('should convert binary data as a single string', () => {
+    const waf = new DDWAF(rules, 'recommended')
+    const context = waf.createContext()
+
+    const buffer = Buffer.from('value_attack')
+    const arrayBuffer = new Uint8Array(buffer).buffer
+
+    for (const value of [buffer, new Uint8Array(buffer), arrayBuffer]) {
+      const result = context.run({
+        ephemeral: {
+          'server.request.headers.no_cookies': value
+        }
+      }, TIMEOUT)
+
+      assert.strictEqual(result.status, 'match')
+      assert.strictEqual(result.events[0].rule_matches[0].parameters[0].value, 'value_attack')
+    }
+  })
+
+  it('should truncate binary data', () => {
+    const waf = new DDWAF(rules, 'recommended')
+    const context = waf.createContext()
+
+    const result = context.run({
+      ephemeral: {
+        'server.request.body': Buffer.alloc(5000)
+      }
+    }, TIMEOUT)
+
+    assert(!result.status)
+    assert.strictEqual(result.metrics.maxTruncatedString, 5000)
+  })
+
   it('should handle multiple truncations in complex nested structure', () => {
     const waf = new DDWAF(rules, 'recommended')
 
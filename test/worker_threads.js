@@ -10,6 +10,7 @@ const { DDWAF } = require('..')
 const rules = require('./rules.json')
 
 const WORKER_PATH = path.join(__dirname, 'worker.js')
+const ATTACHED_WORKER_PATH = path.join(__dirname, 'attached_worker.js')
 
 describe('worker threads', () => {
   it('should not crash when worker created after DDWAF', (done) => {
@@ -62,4 +63,54 @@ describe('worker threads', () => {
       done()
     })
   })
+
+  it('should share a compiled ruleset with attached workers', (done) => {
+    const waf = new DDWAF(rules, 'recommended')
+    const id = waf.share()
+    assert.strictEqual(waf.share(), id)
+
+    const worker = new Worker(ATTACHED_WORKER_PATH, { workerData: { id } })
+
+    worker.once('message', (result1) => {
+      assert.strictEqual(result1.status, 'match')
+      assert(!result1.knownAddresses.includes('waf.context.processor'))
+
+      assert.strictEqual(waf.createOrUpdateConfig(require('./processor.json'), 'processor_rules'), true)
+
+      worker.once('message', (result2) => {
+        assert.strictEqual(result2.status, 'match')
+        assert(result2.knownAddresses.includes('waf.context.processor'))
+
+        waf.dispose()
+        done()
+      })
+
+      worker.postMessage('updated')
+    })
+  })
+
+  it('should wait for a config update made by an attached instance', async () => {
+    const waf = new DDWAF(rules, 'recommended')
+    const attached = DDWAF.attach(waf.share())
+
+    const promise = waf.createOrUpdateConfigAsync(require('./processor.json'), 'processor_rules')
+
+    // the build runs on the threadpool, the sync update lands before or after it but never fails
+    assert.strictEqual(attached.createOrUpdateConfig({
+      rules_data: [{ id: 'blocked_ips', type: 'ip_with_expiration', data: [{ value: '1.2.3.4' }] }]
+    }, 'attached_data'), true)
+    assert.strictEqual(await promise, true)
+
+    assert(attached.configPaths.includes('processor_rules'))
+    assert(attached.configPaths.includes('attached_data'))
+    assert(waf.knownAddresses.has('waf.context.processor'))
+
+    attached.dispose()
+    waf.dispose()
+  })
+
+  it('should throw when attaching to an unknown id', () => {
+    assert.throws(() => DDWAF.attach('1'), new TypeError('First argument must be a number'))
+    assert.throws(() => DDWAF.attach(0), new Error('No DDWAF instance shared with this id'))
+  })
 })